@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Run the benchmark matrix: every device type, every injection path, one
+# frame per syscall and batched. The vinput modules are loaded from the
+# repository if they are not loaded yet. Tunables: FRAMES, RATE (frames/s,
+# 0 = unpaced) and BATCH.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BENCH=$ROOT/bench/vinput-bench
+FRAMES=${FRAMES:-20000}
+RATE=${RATE:-0}
+BATCH=${BATCH:-16}
+
+for mod in vinput vkbd vmouse vts; do
+    grep -q "^$mod " /proc/modules || insmod "$ROOT/$mod.ko"
+done
+
+"$BENCH" -H
+for type in vkbd vmouse vts; do
+    for batch in 1 "$BATCH"; do
+        for mode in text binary ring; do
+            "$BENCH" -t $type -m $mode -b "$batch" -n "$FRAMES" -r "$RATE"
+        done
+    done
+done
+
+if [ -n "$SCALE" ]; then
+    "$ROOT/bench/scale.sh" $SCALE
+fi
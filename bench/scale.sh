@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+#
+# Measure export, open and inject cost as the number of vinput devices grows.
+# Only shell builtins are used in the timed loops, so no fork/exec skews the
+# numbers. Requires bash 5 ($EPOCHREALTIME), root, and the vinput and vkbd
+# modules loaded with max_devices large enough for the biggest step.
+#
+# usage: bench/scale.sh [steps...]    (default: 1 32 256 1024)
+
+set -e
+
+SYSFS=/sys/class/vinput
+STEPS=${*:-"1 32 256 1024"}
+OPENS=1000
+INJECTS=1000
+
+count_devices()
+{
+    local n=0 d
+    for d in "$SYSFS"/vinput*; do
+        [ -e "$d" ] && n=$((n + 1))
+    done
+    echo $n
+}
+
+cleanup()
+{
+    local d
+    for d in "$SYSFS"/vinput*; do
+        [ -e "$d" ] && echo "${d##*/vinput}" > "$SYSFS/unexport"
+    done
+}
+trap cleanup EXIT
+
+[ -w "$SYSFS/export" ] || {
+    echo "$SYSFS/export is not writable, is vinput loaded?" >&2
+    exit 1
+}
+cleanup
+
+printf "%8s %14s %14s %14s\n" devices export_us open_ns inject_ns
+for n in $STEPS; do
+    have=$(count_devices)
+    [ "$n" -gt "$have" ] || continue
+
+    t0=${EPOCHREALTIME/./}
+    for ((i = have; i < n; i++)); do
+        echo vkbd > "$SYSFS/export"
+    done
+    t1=${EPOCHREALTIME/./}
+    export_us=$(((t1 - t0) / (n - have)))
+
+    node=/dev/vinput$((n - 1))
+    for ((i = 0; i < 100 && ! -e $node; i++)); do
+        sleep 0.01
+    done
+
+    t0=${EPOCHREALTIME/./}
+    for ((i = 0; i < OPENS; i++)); do
+        exec {fd}> "$node"
+        exec {fd}>&-
+    done
+    t1=${EPOCHREALTIME/./}
+    open_ns=$(((t1 - t0) * 1000 / OPENS))
+
+    exec {fd}> "$node"
+    t0=${EPOCHREALTIME/./}
+    for ((i = 0; i < INJECTS; i++)); do
+        echo 0 >&$fd
+    done
+    t1=${EPOCHREALTIME/./}
+    exec {fd}>&-
+    inject_ns=$(((t1 - t0) * 1000 / INJECTS))
+
+    printf "%8d %14d %14d %14d\n" "$n" "$export_us" "$open_ns" "$inject_ns"
+done
@@ -0,0 +1,456 @@
+/*
+ * vinput-bench: inject events into a vinput device at a controlled rate and
+ * read them back from the matching evdev node.
+ *
+ * A device of the requested type is exported through sysfs and its
+ * /dev/input/eventN node is grabbed, so no other client sees the events.
+ * The writer stamps every frame before injecting it and a reader thread
+ * stamps it when evdev returns it; the difference is the end-to-end latency.
+ * Frames are paired in order, so latencies are only reported up to the first
+ * SYN_DROPPED, after which the frames lost in the evdev buffer are counted.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../vinput_uapi.h"
+
+#define SYSFS "/sys/class/vinput"
+#define MAX_FRAME 8
+
+enum { MODE_TEXT, MODE_BINARY, MODE_RING };
+
+static const char *mode_names[] = {"text", "binary", "ring"};
+
+struct bench {
+    const char *type;
+    int mode;
+    long frames;
+    long rate;
+    int batch;
+
+    long id;
+    int fd;
+    int evdev;
+
+    uint64_t *sent;
+    uint64_t *recv;
+    long received;
+    long paired;
+    long syscalls;
+    volatile int done;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static int write_file(const char *path, const char *val)
+{
+    int ret;
+    int fd = open(path, O_WRONLY);
+
+    if (fd < 0)
+        return -errno;
+    ret = write(fd, val, strlen(val)) < 0 ? -errno : 0;
+    close(fd);
+
+    return ret;
+}
+
+/* Export a device and return its id, found as the new vinputN entry */
+static long export_device(const char *type)
+{
+    DIR *dir;
+    struct dirent *de;
+    long id, best = -1;
+    char seen[4096] = {0};
+
+    if ((dir = opendir(SYSFS)) == NULL)
+        die(SYSFS);
+    while ((de = readdir(dir)))
+        if (sscanf(de->d_name, "vinput%ld", &id) == 1 && id < 4096)
+            seen[id] = 1;
+    closedir(dir);
+
+    if (write_file(SYSFS "/export", type) < 0)
+        die("export");
+
+    if ((dir = opendir(SYSFS)) == NULL)
+        die(SYSFS);
+    while ((de = readdir(dir)))
+        if (sscanf(de->d_name, "vinput%ld", &id) == 1 && id < 4096 &&
+            !seen[id])
+            best = id;
+    closedir(dir);
+
+    if (best < 0) {
+        fprintf(stderr, "cannot find the exported %s device\n", type);
+        exit(1);
+    }
+
+    return best;
+}
+
+static void calibrate_vts(long id)
+{
+    char path[128];
+    static const char *attrs[][2] = {
+        {"max_x", "1023"}, {"max_y", "1023"},   {"max_z", "255"},
+        {"max_points", "10"}, {"type", "B"},
+    };
+
+    for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+        snprintf(path, sizeof(path), SYSFS "/vinput%ld/%s", id, attrs[i][0]);
+        if (write_file(path, attrs[i][1]) < 0)
+            die(path);
+    }
+}
+
+static int open_evdev(long id)
+{
+    int fd, clk = CLOCK_MONOTONIC;
+    char pattern[128], path[256];
+    glob_t g;
+
+    snprintf(pattern, sizeof(pattern), SYSFS "/vinput%ld/input/input*/event*",
+             id);
+    for (int tries = 0; tries < 100; tries++) {
+        if (glob(pattern, 0, NULL, &g) == 0)
+            break;
+        usleep(10000);
+    }
+    if (g.gl_pathc < 1) {
+        fprintf(stderr, "no evdev node for vinput%ld\n", id);
+        exit(1);
+    }
+
+    snprintf(path, sizeof(path), "/dev/input/%s",
+             strrchr(g.gl_pathv[0], '/') + 1);
+    globfree(&g);
+
+    for (int tries = 0; tries < 100; tries++) {
+        if ((fd = open(path, O_RDONLY)) >= 0)
+            break;
+        usleep(10000);
+    }
+    if (fd < 0)
+        die(path);
+    if (ioctl(fd, EVIOCGRAB, 1) < 0)
+        die("EVIOCGRAB");
+    ioctl(fd, EVIOCSCLOCKID, &clk);
+
+    return fd;
+}
+
+/* Frame n of the workload, as text and as input events */
+static int frame_text(struct bench *b, long n, char *buf)
+{
+    if (!strcmp(b->type, "vkbd"))
+        return sprintf(buf, "%s30\n", n & 1 ? "-" : "+");
+    if (!strcmp(b->type, "vmouse"))
+        return sprintf(buf, "%d,0,0,0\n", n & 1 ? -1 : 1);
+    return sprintf(buf, "1,%ld,100,1\n", 100 + (n & 1));
+}
+
+static int frame_events(struct bench *b, long n, struct input_event *ev)
+{
+    int i = 0;
+
+    memset(ev, 0, sizeof(*ev) * MAX_FRAME);
+    if (!strcmp(b->type, "vkbd")) {
+        ev[i].type = EV_KEY, ev[i].code = KEY_A, ev[i++].value = !(n & 1);
+    } else if (!strcmp(b->type, "vmouse")) {
+        ev[i].type = EV_REL, ev[i].code = REL_X, ev[i++].value = n & 1 ? -1 : 1;
+    } else {
+        ev[i].type = EV_ABS, ev[i].code = ABS_MT_SLOT, ev[i++].value = 0;
+        ev[i].type = EV_ABS, ev[i].code = ABS_MT_TRACKING_ID, ev[i++].value = 1;
+        ev[i].type = EV_ABS, ev[i].code = ABS_MT_POSITION_X;
+        ev[i++].value = 100 + (n & 1);
+        ev[i].type = EV_ABS, ev[i].code = ABS_MT_POSITION_Y, ev[i++].value = 100;
+    }
+    ev[i].type = EV_SYN, ev[i++].code = SYN_REPORT;
+
+    return i;
+}
+
+/* Read frames back until all arrived, or for a second after the writer */
+static void *reader(void *arg)
+{
+    struct bench *b = arg;
+    struct pollfd pfd = {.fd = b->evdev, .events = POLLIN};
+    struct input_event ev[64];
+    ssize_t len;
+    int ret;
+
+    b->paired = -1;
+    while (b->received < b->frames) {
+        ret = poll(&pfd, 1, 1000);
+        if (ret == 0 && b->done)
+            break;
+        if (ret <= 0)
+            continue;
+
+        len = read(b->evdev, ev, sizeof(ev));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            die("read evdev");
+        }
+        uint64_t t = now_ns();
+        for (size_t i = 0; i < len / sizeof(ev[0]); i++) {
+            if (ev[i].type != EV_SYN)
+                continue;
+            if (ev[i].code == SYN_DROPPED && b->paired < 0)
+                b->paired = b->received;
+            if (ev[i].code == SYN_REPORT && b->received < b->frames)
+                b->recv[b->received++] = t;
+        }
+    }
+    if (b->paired < 0)
+        b->paired = b->received;
+
+    return NULL;
+}
+
+static void pace(struct bench *b, long n, uint64_t start)
+{
+    struct timespec ts;
+    uint64_t due;
+
+    if (!b->rate)
+        return;
+    due = start + n * 1000000000ULL / b->rate;
+    ts.tv_sec = due / 1000000000ULL;
+    ts.tv_nsec = due % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void inject_write(struct bench *b, uint64_t start)
+{
+    char *buf = malloc((size_t) b->batch * MAX_FRAME * sizeof(struct input_event));
+    size_t len;
+
+    if (!buf)
+        die("malloc");
+
+    for (long n = 0; n < b->frames; n += b->batch) {
+        pace(b, n, start);
+        len = 0;
+        for (long k = n; k < n + b->batch && k < b->frames; k++) {
+            if (b->mode == MODE_TEXT)
+                len += frame_text(b, k, buf + len);
+            else
+                len += frame_events(b, k, (void *) (buf + len)) *
+                       sizeof(struct input_event);
+        }
+        uint64_t t = now_ns();
+        for (long k = n; k < n + b->batch && k < b->frames; k++)
+            b->sent[k] = t;
+        if (write(b->fd, buf, len) != (ssize_t) len)
+            die("write");
+        b->syscalls++;
+    }
+
+    free(buf);
+}
+
+static void inject_ring(struct bench *b, uint64_t start)
+{
+    const uint32_t entries = 4096;
+    struct vinput_ring_setup setup = {.entries = entries};
+    struct input_event ev[MAX_FRAME];
+    struct vinput_ring *ring;
+    struct input_event *slots;
+    size_t size;
+    uint32_t head;
+    int count;
+
+    if (ioctl(b->fd, VINPUT_IOCTL_RING_SETUP, &setup) < 0)
+        die("VINPUT_IOCTL_RING_SETUP");
+    b->syscalls++;
+
+    size = sysconf(_SC_PAGESIZE) + entries * sizeof(struct input_event);
+    ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (ring == MAP_FAILED)
+        die("mmap");
+    slots = (void *) ((char *) ring + ring->offset);
+    head = ring->head;
+
+    for (long n = 0; n < b->frames; n += b->batch) {
+        pace(b, n, start);
+        for (long k = n; k < n + b->batch && k < b->frames; k++) {
+            count = frame_events(b, k, ev);
+            while (head + count - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >
+                   entries) {
+                ioctl(b->fd, VINPUT_IOCTL_RING_KICK);
+                b->syscalls++;
+            }
+            for (int i = 0; i < count; i++)
+                slots[head++ & (entries - 1)] = ev[i];
+        }
+        uint64_t t = now_ns();
+        for (long k = n; k < n + b->batch && k < b->frames; k++)
+            b->sent[k] = t;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        if (ioctl(b->fd, VINPUT_IOCTL_RING_KICK) < 0)
+            die("VINPUT_IOCTL_RING_KICK");
+        b->syscalls++;
+    }
+
+    munmap(ring, size);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(struct bench *b, uint64_t elapsed)
+{
+    long n = b->paired;
+    uint64_t *lat = calloc(n + 1, sizeof(uint64_t));
+
+    if (!lat)
+        die("calloc");
+    for (long i = 0; i < n; i++)
+        lat[i] = b->recv[i] - b->sent[i];
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+    printf("%-7s %-7s %6d %10.0f %10.4f %9.1f %9.1f %9.1f %8ld\n", b->type,
+           mode_names[b->mode], b->batch, b->frames * 1e9 / elapsed,
+           (double) b->syscalls / b->frames, lat[n / 2] / 1e3,
+           lat[n * 99 / 100] / 1e3, lat[n * 999 / 1000] / 1e3,
+           b->frames - b->received);
+    free(lat);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t vkbd|vmouse|vts] [-m text|binary|ring] [-n frames]\n"
+            "          [-r frames/s, 0 = unpaced] [-b frames per syscall] [-H]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .type = "vkbd",
+        .mode = MODE_TEXT,
+        .frames = 100000,
+        .batch = 1,
+    };
+    char path[64], id[32];
+    pthread_t thread;
+    uint64_t start, elapsed;
+    int opt, mode;
+
+    while ((opt = getopt(argc, argv, "t:m:n:r:b:H")) != -1) {
+        switch (opt) {
+        case 't':
+            b.type = optarg;
+            break;
+        case 'm':
+            for (b.mode = 0; b.mode < 3; b.mode++)
+                if (!strcmp(optarg, mode_names[b.mode]))
+                    break;
+            if (b.mode == 3)
+                usage(argv[0]);
+            break;
+        case 'n':
+            b.frames = atol(optarg);
+            break;
+        case 'r':
+            b.rate = atol(optarg);
+            break;
+        case 'b':
+            b.batch = atoi(optarg);
+            break;
+        case 'H':
+            printf("%-7s %-7s %6s %10s %10s %9s %9s %9s %8s\n", "type",
+                   "mode", "batch", "frames/s", "sys/frame", "p50_us",
+                   "p99_us", "p999_us", "lost");
+            return 0;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (strcmp(b.type, "vkbd") && strcmp(b.type, "vmouse") &&
+        strcmp(b.type, "vts"))
+        usage(argv[0]);
+    if (b.frames < 1 || b.batch < 1 || b.rate < 0)
+        usage(argv[0]);
+
+    b.sent = calloc(b.frames, sizeof(uint64_t));
+    b.recv = calloc(b.frames, sizeof(uint64_t));
+    if (!b.sent || !b.recv)
+        die("calloc");
+
+    b.id = export_device(b.type);
+    if (!strcmp(b.type, "vts"))
+        calibrate_vts(b.id);
+
+    snprintf(path, sizeof(path), "/dev/vinput%ld", b.id);
+    for (int tries = 0; tries < 100; tries++) {
+        if ((b.fd = open(path, O_RDWR)) >= 0)
+            break;
+        usleep(10000);
+    }
+    if (b.fd < 0)
+        die(path);
+    if (b.mode == MODE_BINARY) {
+        mode = VINPUT_MODE_BINARY;
+        if (ioctl(b.fd, VINPUT_IOCTL_SET_MODE, &mode) < 0)
+            die("VINPUT_IOCTL_SET_MODE");
+    }
+    b.evdev = open_evdev(b.id);
+
+    if (pthread_create(&thread, NULL, reader, &b))
+        die("pthread_create");
+
+    start = now_ns();
+    if (b.mode == MODE_RING)
+        inject_ring(&b, start);
+    else
+        inject_write(&b, start);
+    elapsed = now_ns() - start;
+    b.done = 1;
+    pthread_join(thread, NULL);
+
+    report(&b, elapsed);
+
+    close(b.evdev);
+    close(b.fd);
+    snprintf(id, sizeof(id), "%ld", b.id);
+    write_file(SYSFS "/unexport", id);
+
+    return 0;
+}
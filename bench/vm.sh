@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# Run bench/run.sh unattended in a virtme-ng VM booting the kernel built in
+# KDIR, the same tree the modules are built against. Results go to stdout,
+# e.g. bench/vm.sh > bench-$(git rev-parse --short HEAD).txt
+#
+# usage: KDIR=~/linux bench/vm.sh
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+KDIR=${KDIR:-/lib/modules/$(uname -r)/build}
+
+make -C "$ROOT" KDIR="$KDIR" >&2
+make -C "$ROOT/bench" >&2
+
+exec vng --run "$KDIR" --user root --rwdir "$ROOT" \
+    --exec "FRAMES=${FRAMES:-20000} RATE=${RATE:-0} BATCH=${BATCH:-16} \
+SCALE='${SCALE:-}' $ROOT/bench/run.sh"
@@ -1,23 +1,118 @@
+#include <linux/capability.h>
 #include <linux/cdev.h>
+#include <linux/compat.h>
+#include <linux/configfs.h>
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/idr.h>
 #include <linux/input.h>
+#include <linux/input/mt.h>
+#include <linux/io_uring.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
-
-#include <asm/uaccess.h>
+#include <linux/srcu.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#endif
 
 #include "vinput.h"
+#include "vinput_parse.h"
+#include "vinput_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "vinput_trace.h"
 
 #define DRIVER_NAME "vinput"
+#define VINPUT_BATCH 64
+#define VINPUT_RING_MIN_SLEEP_US 10
+#define VINPUT_RING_MAX_SLEEP_US 1000
+
+/* bit of vinput->flags held by the frame consumer */
+#define VINPUT_BUSY 0
 
 #define dev_to_vinput(dev) container_of(dev, struct vinput, dev)
 
-static DECLARE_BITMAP(vinput_ids, VINPUT_MINORS);
+static unsigned int max_devices = VINPUT_MAX_DEVICES;
+module_param(max_devices, uint, 0444);
+MODULE_PARM_DESC(max_devices, "Maximum number of virtual input devices");
+
+static unsigned int capture_size;
+module_param(capture_size, uint, 0444);
+MODULE_PARM_DESC(capture_size,
+                 "Default capture ring size in events, a power of 2 or 0");
+
+static bool latency_probe;
+module_param(latency_probe, bool, 0444);
+MODULE_PARM_DESC(latency_probe,
+                 "Measure the delivery latency of injected frames to handlers");
+
+static DEFINE_IDA(vinput_ids);
+
+/*
+ * Per device, per CPU injection counters. latency is a log2 histogram of
+ * the nanoseconds from the queueing of each frame to the return of its
+ * input_sync(): bucket n counts the frames that took [2^(n-1), 2^n) ns,
+ * whichever producer emitted them. delivery is the same
+ * histogram for the time from injection to the delivery of each frame by
+ * the input core, filled by the latency probe handler, and lateness for the
+ * time by which players missed the schedule of their frames.
+ */
+#define VINPUT_LAT_BUCKETS 32
+
+struct vinput_stats {
+    u64 writes;
+    u64 events;
+    u64 frames;
+    u64 bytes;
+    u64 parse_errors;
+    u64 rejected;
+    u64 dropped;
+    u64 latency[VINPUT_LAT_BUCKETS];
+    u64 delivery[VINPUT_LAT_BUCKETS];
+    u64 lateness[VINPUT_LAT_BUCKETS];
+};
+
+static struct dentry *vinput_debugfs;
 
 static LIST_HEAD(vinput_devices);
-static LIST_HEAD(vinput_vdevices);
 
-static int vinput_dev;
+/*
+ * Exported virtual devices indexed by id. The entry owns the device
+ * reference taken by device_initialize(); whoever erases it tears the device
+ * down. Lookups run under RCU and the memory is freed after a grace period.
+ */
+static DEFINE_XARRAY(vinput_vdevices);
+/* the same, for the devices owned by control files, out of sysfs reach */
+static DEFINE_XARRAY(vinput_owned);
+
+static struct xarray *vinput_xa(struct vinput *vinput)
+{
+    return vinput->owned ? &vinput_owned : &vinput_vdevices;
+}
+
+/* injection sections, see vinput_enter() */
+DEFINE_STATIC_SRCU(vinput_srcu);
+
+/* devices gone so far, for the users caching them to forget them */
+static atomic_t vinput_deaths = ATOMIC_INIT(0);
+
+static dev_t vinput_devt;
 static struct spinlock vinput_lock;
 static struct class vinput_class;
 
@@ -42,351 +137,4008 @@ struct vinput_device *vinput_get_device_by_type(const char *type)
     return ERR_PTR(-ENODEV);
 }
 
-struct vinput *vinput_get_vdevice_by_id(long id)
+static struct vinput *vinput_get_vdevice(struct xarray *xa, long id)
 {
-    struct vinput *vinput = NULL;
-    struct list_head *curr;
+    struct vinput *vinput;
 
-    spin_lock(&vinput_lock);
-    list_for_each (curr, &vinput_vdevices) {
-        vinput = list_entry(curr, struct vinput, list);
-        if (vinput && vinput->id == id)
-            break;
-    }
-    spin_unlock(&vinput_lock);
+    rcu_read_lock();
+    vinput = xa_load(xa, id);
+    if (vinput && !kobject_get_unless_zero(&vinput->dev.kobj))
+        vinput = NULL;
+    rcu_read_unlock();
 
-    if (vinput && vinput->id == id)
+    if (vinput)
         return vinput;
     return ERR_PTR(-ENODEV);
 }
 
-static int vinput_open(struct inode *inode, struct file *file)
+/* Look up an exported device and take a reference, put_device() it */
+struct vinput *vinput_get_vdevice_by_id(long id)
 {
-    int err = 0;
-    struct vinput *vinput = NULL;
-
-    vinput = vinput_get_vdevice_by_id(iminor(inode));
+    return vinput_get_vdevice(&vinput_vdevices, id);
+}
 
-    if (IS_ERR(vinput))
-        err = PTR_ERR(vinput);
-    else
-        file->private_data = vinput;
+/*
+ * Injection into a device runs in an SRCU read section and is refused once
+ * the device is dead, so that unexport can wait for the writers in flight
+ * before the input device and the driver data go away.
+ */
+static bool vinput_enter(struct vinput *vinput, int *idx)
+{
+    *idx = srcu_read_lock(&vinput_srcu);
+    if (!READ_ONCE(vinput->dead))
+        return true;
 
-    return err;
+    srcu_read_unlock(&vinput_srcu, *idx);
+    return false;
 }
 
-static int vinput_release(struct inode *inode, struct file *file)
+static void vinput_leave(int idx)
 {
-    return 0;
+    srcu_read_unlock(&vinput_srcu, idx);
 }
 
-static ssize_t vinput_read(struct file *file,
-                           char __user *buffer,
-                           size_t count,
-                           loff_t *offset)
+/*
+ * Report an event to the input core. Events and frames are traced through
+ * the vinput:inject and vinput:frame tracepoints, which are patched out by
+ * static keys while nobody is tracing them.
+ */
+static void vinput_event(struct vinput *vinput,
+                         unsigned int type,
+                         unsigned int code,
+                         int value)
 {
-    int len;
-    char buff[VINPUT_MAX_LEN + 1];
-    struct vinput *vinput = file->private_data;
+    trace_inject(vinput, type, code, value);
 
-    len = vinput->type->ops->read(vinput, buff, count);
+    if (type == EV_SYN && code == SYN_REPORT) {
+        trace_frame(vinput, vinput->frame_len);
+        this_cpu_inc(vinput->stats->frames);
+        vinput->frame_len = 0;
+    } else {
+        this_cpu_inc(vinput->stats->events);
+        vinput->frame_len++;
+    }
 
-    if (*offset > len)
-        count = 0;
-    else if (count + *offset > VINPUT_MAX_LEN)
-        count = len - *offset;
+    input_event(vinput->input, type, code, value);
+}
 
-    if (raw_copy_to_user(buffer, buff + *offset, count))
-        count = -EFAULT;
+/* Allocate a frame for up to size events */
+struct vinput_frame *vinput_frame_alloc(unsigned int size, gfp_t gfp)
+{
+    struct vinput_frame *frame;
 
-    *offset += count;
+    frame = kmalloc(struct_size(frame, events, size), gfp);
+    if (!frame)
+        return NULL;
 
-    return count;
+    frame->flags = 0;
+    frame->count = 0;
+    frame->size = size;
+    frame->timestamp = 0;
+    frame->inject_ns = 0;
+
+    return frame;
 }
+EXPORT_SYMBOL(vinput_frame_alloc);
 
-static ssize_t vinput_write(struct file *file,
-                            const char __user *buffer,
-                            size_t count,
-                            loff_t *offset)
+void vinput_frame_add(struct vinput_frame *frame,
+                      unsigned int type,
+                      unsigned int code,
+                      int value)
 {
-    char buff[VINPUT_MAX_LEN + 1];
-    struct vinput *vinput = file->private_data;
-
-    memset(buff, 0, sizeof(char) * (VINPUT_MAX_LEN + 1));
-
-    if (count > VINPUT_MAX_LEN) {
-        dev_warn(&vinput->dev, "Too long. %d bytes allowed\n", VINPUT_MAX_LEN);
-        return -EINVAL;
-    }
+    if (WARN_ON_ONCE(frame->count == frame->size))
+        return;
 
-    if (raw_copy_from_user(buff, buffer, count))
-        return -EFAULT;
+    frame->events[frame->count++] = (struct input_value){
+        .type = type,
+        .code = code,
+        .value = value,
+    };
+}
+EXPORT_SYMBOL(vinput_frame_add);
 
-    return vinput->type->ops->send(vinput, buff, count);
+/*
+ * Queue a frame without emitting it. Drivers queue their frames under
+ * vinput->lock, along with the state update they derive from, so that
+ * frames are emitted in the order of that state, then call
+ * vinput_frame_flush() once the lock is dropped.
+ */
+void vinput_frame_queue(struct vinput *vinput, struct vinput_frame *frame)
+{
+    frame->inject_ns = ktime_get_ns();
+    llist_add(&frame->node, &vinput->frames);
 }
+EXPORT_SYMBOL(vinput_frame_queue);
 
-static const struct file_operations vinput_fops = {
-    .owner = THIS_MODULE,
-    .open = vinput_open,
-    .release = vinput_release,
-    .read = vinput_read,
-    .write = vinput_write,
+/*
+ * Capture ring: every emitted frame is recorded, with its events, the final
+ * SYN_REPORT and the monotonic time of its emission, in a per device ring of
+ * capture_size records. Each open file reads it from its own cursor, records
+ * overwritten before they were read being reported as a SYN_DROPPED record
+ * and counted as dropped. The ring is only written by the frame consumer.
+ */
+struct vinput_record {
+    u64 time;
+    struct input_value v;
 };
 
-static void vinput_unregister_vdevice(struct vinput *vinput)
-{
-    input_unregister_device(vinput->input);
-    if (vinput->type->ops->kill)
-        vinput->type->ops->kill(vinput);
-}
+#define VINPUT_CAPTURE_MAX (1 << 20)
+#define VINPUT_CAPTURE_BATCH 64
+/* "%llu.%06lu %u %u %d\n" */
+#define VINPUT_CAPTURE_LINE 64
 
-static void vinput_destroy_vdevice(struct vinput *vinput)
+static int vinput_capture_resize(struct vinput *vinput, unsigned int size)
 {
-    /* Remove from the list first */
-    spin_lock(&vinput_lock);
-    list_del(&vinput->list);
-    clear_bit(vinput->id, vinput_ids);
-    spin_unlock(&vinput_lock);
+    unsigned long flags;
+    struct vinput_record *capture = NULL;
 
-    module_put(THIS_MODULE);
+    if (size > VINPUT_CAPTURE_MAX || (size && !is_power_of_2(size)))
+        return -EINVAL;
 
-    kfree(vinput);
-}
+    if (size) {
+        capture = kvmalloc_array(size, sizeof(struct vinput_record),
+                                 GFP_KERNEL);
+        if (!capture)
+            return -ENOMEM;
+    }
 
-static void vinput_release_dev(struct device *dev)
-{
-    struct vinput *vinput = dev_to_vinput(dev);
-    int id = vinput->id;
+    spin_lock_irqsave(&vinput->capture_lock, flags);
+    swap(vinput->capture, capture);
+    WRITE_ONCE(vinput->capture_size, size);
+    vinput->capture_tail = vinput->capture_head;
+    spin_unlock_irqrestore(&vinput->capture_lock, flags);
 
-    vinput_destroy_vdevice(vinput);
+    kvfree(capture);
 
-    pr_debug("released vinput%d.\n", id);
+    return 0;
 }
 
-static struct vinput *vinput_alloc_vdevice(void)
+static void vinput_capture(struct vinput *vinput, struct vinput_frame *frame)
 {
-    int err;
-    struct vinput *vinput = kzalloc(sizeof(struct vinput), GFP_KERNEL);
-
-    try_module_get(THIS_MODULE);
+    unsigned int i;
+    unsigned int mask;
+    unsigned long flags;
+    u64 now;
+    struct vinput_record *rec;
 
-    memset(vinput, 0, sizeof(struct vinput));
+    if (!READ_ONCE(vinput->capture_size))
+        return;
 
-    spin_lock_init(&vinput->lock);
+    now = frame->timestamp ? ktime_to_ns(frame->timestamp) : ktime_get_ns();
 
-    spin_lock(&vinput_lock);
-    vinput->id = find_first_zero_bit(vinput_ids, VINPUT_MINORS);
-    if (vinput->id >= VINPUT_MINORS) {
-        err = -ENOBUFS;
-        goto fail_id;
+    spin_lock_irqsave(&vinput->capture_lock, flags);
+    mask = vinput->capture_size - 1;
+    for (i = 0; vinput->capture && i <= frame->count; i++) {
+        rec = &vinput->capture[vinput->capture_head++ & mask];
+        rec->time = now;
+        if (i < frame->count)
+            rec->v = frame->events[i];
+        else
+            rec->v = (struct input_value){ .type = EV_SYN,
+                                           .code = SYN_REPORT };
     }
-    set_bit(vinput->id, vinput_ids);
-    list_add(&vinput->list, &vinput_vdevices);
-    spin_unlock(&vinput_lock);
+    if (vinput->capture_head - vinput->capture_tail > mask + 1)
+        vinput->capture_tail = vinput->capture_head - mask - 1;
+    spin_unlock_irqrestore(&vinput->capture_lock, flags);
 
-    /* allocate the input device */
-    vinput->input = input_allocate_device();
-    if (vinput->input == NULL) {
-        pr_err("vinput: Cannot allocate vinput input device\n");
-        err = -ENOMEM;
-        goto fail_input_dev;
-    }
+    if (wq_has_sleeper(&vinput->capture_wait))
+        wake_up_interruptible_poll(&vinput->capture_wait,
+                                   EPOLLIN | EPOLLRDNORM);
+}
 
-    /* initialize device */
-    vinput->dev.class = &vinput_class;
-    vinput->dev.release = vinput_release_dev;
-    vinput->dev.devt = MKDEV(vinput_dev, vinput->id);
-    dev_set_name(&vinput->dev, DRIVER_NAME "%lu", vinput->id);
+static void vinput_frame_emit(struct vinput *vinput, struct vinput_frame *frame)
+{
+    int bucket;
+    unsigned int i;
+    struct input_value *v;
 
-    return vinput;
+    if (frame->timestamp)
+        input_set_timestamp(vinput->input, frame->timestamp);
+    /* for the latency probe, which handlers call within input_sync() */
+    WRITE_ONCE(vinput->inject_ns, frame->inject_ns);
+    for (i = 0; i < frame->count; i++) {
+        v = &frame->events[i];
+        vinput_event(vinput, v->type, v->code, v->value);
+    }
+    /* emulate the pointer from the slots as the frame leaves them */
+    if (frame->flags & VINPUT_FRAME_MT_SYNC)
+        input_mt_sync_frame(vinput->input);
+    if (frame->flags & VINPUT_FRAME_MT_POINTER)
+        input_mt_report_pointer_emulation(vinput->input, true);
+    vinput_event(vinput, EV_SYN, SYN_REPORT, 0);
+    WRITE_ONCE(vinput->inject_ns, 0);
 
-fail_input_dev:
-    spin_lock(&vinput_lock);
-    list_del(&vinput->list);
-fail_id:
-    spin_unlock(&vinput_lock);
-    module_put(THIS_MODULE);
-    kfree(vinput);
+    bucket = min(fls64(ktime_get_ns() - frame->inject_ns),
+                 VINPUT_LAT_BUCKETS - 1);
+    this_cpu_inc(vinput->stats->latency[bucket]);
 
-    return ERR_PTR(err);
+    vinput_capture(vinput, frame);
 }
 
-static int vinput_register_vdevice(struct vinput *vinput)
+/* Release VINPUT_BUSY and wake a transaction waiting for it */
+static void vinput_frame_unlock(struct vinput *vinput)
 {
-    int err = 0;
+    clear_bit_unlock(VINPUT_BUSY, &vinput->flags);
+    /* orders the clear before the check, as the flush loop needs too */
+    if (wq_has_sleeper(&vinput->busy_wait))
+        wake_up(&vinput->busy_wait);
+}
 
-    /* register the input device */
-    vinput->input->name = vinput->type->name;
-    vinput->input->phys = "vinput";
-    vinput->input->dev.parent = &vinput->dev;
+/* Emit the frames queued so far, with VINPUT_BUSY held */
+static void vinput_frame_drain(struct vinput *vinput)
+{
+    struct llist_node *list;
+    struct vinput_frame *frame, *next;
 
-    vinput->input->id.bustype = BUS_VIRTUAL;
-    vinput->input->id.product = 0x0000;
-    vinput->input->id.vendor = 0x0000;
-    vinput->input->id.version = 0x0000;
+    list = llist_reverse_order(llist_del_all(&vinput->frames));
+    llist_for_each_entry_safe (frame, next, list, node) {
+        vinput_frame_emit(vinput, frame);
+        kfree(frame);
+    }
+}
 
-    err = vinput->type->ops->init(vinput);
+/*
+ * Emit the queued frames. Any number of producers queue frames locklessly;
+ * the first one to find the device idle becomes its consumer and emits
+ * every queued frame in order, each one up to its input_sync(), including
+ * the frames queued by others meanwhile. A producer finding the device busy
+ * returns at once and leaves its frame to the consumer, which looks at the
+ * queue again after it releases the device.
+ */
+void vinput_frame_flush(struct vinput *vinput)
+{
+    while (!llist_empty(&vinput->frames)) {
+        if (test_and_set_bit(VINPUT_BUSY, &vinput->flags))
+            return;
 
-    if (err == 0)
-        dev_info(&vinput->dev, "Registered virtual input %s %ld\n",
-                 vinput->type->name, vinput->id);
+        vinput_frame_drain(vinput);
+        vinput_frame_unlock(vinput);
+    }
+}
+EXPORT_SYMBOL(vinput_frame_flush);
 
-    return err;
+void vinput_frame_submit(struct vinput *vinput, struct vinput_frame *frame)
+{
+    vinput_frame_queue(vinput, frame);
+    vinput_frame_flush(vinput);
 }
+EXPORT_SYMBOL(vinput_frame_submit);
 
-static ssize_t export_store(struct class *class,
-                            struct class_attribute *attr,
-                            const char *buf,
-                            size_t len)
+/* frames a player emits per timer expiry when it runs behind its schedule */
+#define VINPUT_PLAYER_BURST 64
+
+static enum hrtimer_restart vinput_player_fire(struct hrtimer *timer)
 {
-    int err;
-    struct vinput *vinput;
-    struct vinput_device *device;
+    int idx;
+    int n = 0;
+    int bucket;
+    u64 late;
+    ktime_t now, due;
+    struct vinput_player *player =
+        container_of(timer, struct vinput_player, timer);
+    struct vinput *vinput = player->vinput;
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
 
-    device = vinput_get_device_by_type(buf);
-    if (IS_ERR(device)) {
-        pr_info("vinput: This virtual device isn't registered\n");
-        err = PTR_ERR(device);
-        goto fail;
+    if (!vinput_enter(vinput, &idx)) {
+        WRITE_ONCE(player->running, false);
+        return HRTIMER_NORESTART;
     }
 
-    vinput = vinput_alloc_vdevice();
-    if (IS_ERR(vinput)) {
-        err = PTR_ERR(vinput);
-        goto fail;
-    }
+    now = ktime_get();
+    for (;;) {
+        if (!player->frame)
+            player->frame = player->next(player, &player->when);
+        if (!player->frame) {
+            WRITE_ONCE(player->running, false);
+            break;
+        }
 
-    vinput->type = device;
-    err = device_register(&vinput->dev);
-    if (err < 0)
-        goto fail_register;
+        due = player->speed ?
+                  ktime_add_ns(player->start,
+                               mul_u64_u32_div(player->when, 1000,
+                                               player->speed)) :
+                  now;
+        if (ktime_after(due, now) || n == VINPUT_PLAYER_BURST) {
+            hrtimer_set_expires(timer, ktime_after(due, now) ? due : now);
+            ret = HRTIMER_RESTART;
+            break;
+        }
 
-    err = vinput_register_vdevice(vinput);
-    if (err < 0)
-        goto fail_register_vinput;
+        late = ktime_to_ns(ktime_sub(now, due));
+        bucket = min(fls64(late), VINPUT_LAT_BUCKETS - 1);
+        this_cpu_inc(vinput->stats->lateness[bucket]);
+        trace_play(vinput, player->played, late);
+        player->late_max = max(player->late_max, late);
+        player->late_sum += late;
+        player->played++;
 
-    return len;
+        if (player->stamp)
+            player->frame->timestamp = ktime_add_ns(player->start,
+                                                    player->when);
+        vinput_frame_queue(vinput, player->frame);
+        player->frame = NULL;
+        n++;
+    }
 
-fail_register_vinput:
-    device_unregister(&vinput->dev);
-fail_register:
-    vinput_destroy_vdevice(vinput);
-fail:
-    return err;
+    vinput_frame_flush(vinput);
+    vinput_leave(idx);
+
+    return ret;
 }
-static CLASS_ATTR_WO(export);
 
-static ssize_t unexport_store(struct class *class,
-                              struct class_attribute *attr,
-                              const char *buf,
-                              size_t len)
+void vinput_player_init(struct vinput_player *player,
+                        struct vinput *vinput,
+                        struct vinput_frame *(*next)(struct vinput_player *,
+                                                     u64 *))
 {
-    int err;
-    unsigned long id;
-    struct vinput *vinput;
-
-    err = kstrtol(buf, 10, &id);
-    if (err) {
-        err = -EINVAL;
-        goto failed;
-    }
+    memset(player, 0, sizeof(*player));
+    hrtimer_init(&player->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    player->timer.function = vinput_player_fire;
+    player->vinput = vinput;
+    player->next = next;
+}
+EXPORT_SYMBOL(vinput_player_init);
 
-    vinput = vinput_get_vdevice_by_id(id);
-    if (IS_ERR(vinput)) {
-        pr_err("vinput: No such vinput device %ld\n", id);
-        err = PTR_ERR(vinput);
-        goto failed;
-    }
+/* Start playing the frames returned by next(), the player being stopped */
+void vinput_player_start(struct vinput_player *player, unsigned int speed)
+{
+    player->speed = speed;
+    player->played = 0;
+    player->late_max = 0;
+    player->late_sum = 0;
+    player->start = ktime_get();
+    WRITE_ONCE(player->running, true);
+    hrtimer_start(&player->timer, player->start, HRTIMER_MODE_ABS_SOFT);
+}
+EXPORT_SYMBOL(vinput_player_start);
 
-    vinput_unregister_vdevice(vinput);
-    device_unregister(&vinput->dev);
+/* Stop a player and wait for its timer, dropping the frame it held back */
+void vinput_player_stop(struct vinput_player *player)
+{
+    hrtimer_cancel(&player->timer);
+    WRITE_ONCE(player->running, false);
+    kfree(player->frame);
+    player->frame = NULL;
+}
+EXPORT_SYMBOL(vinput_player_stop);
 
-    return len;
-failed:
-    return err;
+/*
+ * Report a command the driver failed to parse to vinput:parse_error, pos
+ * being the offset in buff at which parsing stopped.
+ */
+void vinput_parse_error(struct vinput *vinput,
+                        const char *buff,
+                        int len,
+                        int pos,
+                        int err)
+{
+    trace_parse_error(vinput, buff, len, pos, err);
+    this_cpu_inc(vinput->stats->parse_errors);
 }
-static CLASS_ATTR_WO(unexport);
+EXPORT_SYMBOL(vinput_parse_error);
 
-static struct attribute *vinput_class_attrs[] = {
-    &class_attr_export.attr,
-    &class_attr_unexport.attr,
-    NULL,
+/* trace handed to VINPUT_IOCTL_REPLAY_START, played by a vinput_player */
+struct vinput_replay_buf {
+    struct vinput_player player;
+    struct vinput_frame **frames;
+    u64 *offsets;
+    unsigned int count;
+    unsigned int next;
 };
 
-ATTRIBUTE_GROUPS(vinput_class);
+/* kernel side of a mmap()ed injection ring */
+struct vinput_ring_buf {
+    struct vinput_ring *hdr;
+    struct input_event *events;
+    size_t size;
+    u32 mask;
+    u32 tail;
 
-static struct class vinput_class = {
-    .name = "vinput",
-    .owner = THIS_MODULE,
-    .class_groups = vinput_class_groups,
+    struct task_struct *thread;
 };
 
-int vinput_register(struct vinput_device *dev)
+/* per open file state of a /dev/vinputX node */
+struct vinput_file {
+    struct vinput *vinput;
+    int mode;
+    struct mutex lock;
+
+    struct input_event *events;
+
+    /* binary records of the frame in progress, see vinput_stage_event() */
+    struct input_value *stage;
+    unsigned int staged;
+
+    /* text mode line carried over from previous writes */
+    char line[VINPUT_MAX_LEN + 1];
+    int line_len;
+    bool overflow;
+
+    struct vinput_ring_buf *ring;
+    struct vinput_replay_buf *replay;
+
+    /* next record of the capture ring to read */
+    u64 cursor;
+
+    /* bytes routed by a mux file and not accounted yet */
+    size_t routed;
+};
+
+/* Allocate the state of a file opened on vinput, taking a reference */
+static struct vinput_file *vinput_file_alloc(struct vinput *vinput)
 {
-    spin_lock(&vinput_lock);
-    list_add(&dev->list, &vinput_devices);
-    spin_unlock(&vinput_lock);
+    struct vinput_file *vfile;
 
-    pr_info("vinput: registered new virtual input device '%s'\n", dev->name);
+    if (READ_ONCE(vinput->dead))
+        return ERR_PTR(-ENODEV);
 
-    return 0;
+    vfile = kzalloc(sizeof(struct vinput_file), GFP_KERNEL);
+    if (!vfile)
+        return ERR_PTR(-ENOMEM);
+
+    get_device(&vinput->dev);
+    vfile->vinput = vinput;
+    vfile->mode = VINPUT_MODE_TEXT;
+    mutex_init(&vfile->lock);
+    spin_lock_irq(&vinput->capture_lock);
+    vfile->cursor = vinput->capture_tail;
+    spin_unlock_irq(&vinput->capture_lock);
+
+    return vfile;
 }
-EXPORT_SYMBOL(vinput_register);
 
-void vinput_unregister(struct vinput_device *dev)
+static int vinput_open(struct inode *inode, struct file *file)
 {
-    struct list_head *curr, *next;
+    struct vinput *vinput = container_of(inode->i_cdev, struct vinput, cdev);
+    struct vinput_file *vfile;
 
-    /* Remove from the list first */
-    spin_lock(&vinput_lock);
-    list_del(&dev->list);
-    spin_unlock(&vinput_lock);
+    if (vinput->owned)
+        return -EPERM;
 
-    /* unregister all devices of this type */
-    list_for_each_safe (curr, next, &vinput_vdevices) {
-        struct vinput *vinput = list_entry(curr, struct vinput, list);
-        if (vinput && vinput->type == dev) {
-            vinput_unregister_vdevice(vinput);
-            device_unregister(&vinput->dev);
-        }
-    }
+    vfile = vinput_file_alloc(vinput);
+    if (IS_ERR(vfile))
+        return PTR_ERR(vfile);
+    file->private_data = vfile;
 
-    pr_info("vinput: unregistered virtual input device '%s'\n", dev->name);
+    return 0;
 }
-EXPORT_SYMBOL(vinput_unregister);
 
-static int __init vinput_init(void)
+/* Check an event against the capability bitmaps of the input device */
+static bool vinput_event_supported(struct input_dev *input,
+                                   unsigned int type,
+                                   unsigned int code)
 {
-    int err = 0;
+    unsigned long *bits;
+    unsigned int max;
 
-    pr_info("vinput: Loading virtual input driver\n");
+    if (type > EV_MAX || !test_bit(type, input->evbit))
+        return false;
 
-    vinput_dev = register_chrdev(0, DRIVER_NAME, &vinput_fops);
-    if (vinput_dev < 0) {
-        pr_err("vinput: Unable to allocate char dev region\n");
-        goto failed_alloc;
+    switch (type) {
+    case EV_SYN:
+        return code == SYN_REPORT || code == SYN_MT_REPORT;
+    case EV_REP:
+        return code <= REP_MAX;
+    case EV_KEY:
+        bits = input->keybit;
+        max = KEY_MAX;
+        break;
+    case EV_REL:
+        bits = input->relbit;
+        max = REL_MAX;
+        break;
+    case EV_ABS:
+        bits = input->absbit;
+        max = ABS_MAX;
+        break;
+    case EV_MSC:
+        bits = input->mscbit;
+        max = MSC_MAX;
+        break;
+    case EV_LED:
+        bits = input->ledbit;
+        max = LED_MAX;
+        break;
+    case EV_SND:
+        bits = input->sndbit;
+        max = SND_MAX;
+        break;
+    case EV_FF:
+        bits = input->ffbit;
+        max = FF_MAX;
+        break;
+    case EV_SW:
+        bits = input->swbit;
+        max = SW_MAX;
+        break;
+    default:
+        return false;
     }
 
-    spin_lock_init(&vinput_lock);
+    return code <= max && test_bit(code, bits);
+}
 
-    err = class_register(&vinput_class);
-    if (err < 0) {
-        pr_err("vinput: Unable to register vinput class\n");
-        goto failed_class;
-    }
+/* Allocate the frame staging area of binary records, under vfile->lock */
+static int vinput_stage_alloc(struct vinput_file *vfile)
+{
+    if (vfile->stage)
+        return 0;
+
+    vfile->stage = kmalloc_array(VINPUT_FRAME_MAX_EVENTS,
+                                 sizeof(struct input_value), GFP_KERNEL);
+    if (!vfile->stage)
+        return -ENOMEM;
+    vfile->staged = 0;
 
     return 0;
-failed_class:
-    class_unregister(&vinput_class);
-failed_alloc:
-    return err;
+}
+
+/*
+ * Binary records are struct input_event, whose time fields are 32 bits
+ * wide for a 32 bit task on a 64 bit kernel. write() and read() of
+ * /dev/vinputX translate them, the other binary interfaces refuse them.
+ */
+#ifndef COMPAT_USE_64BIT_TIME
+#define COMPAT_USE_64BIT_TIME 0
+#endif
+
+#ifdef CONFIG_COMPAT
+struct vinput_compat_event {
+    compat_ulong_t sec;
+    compat_ulong_t usec;
+    __u16 type;
+    __u16 code;
+    __s32 value;
+};
+#endif
+
+static bool vinput_compat_events(void)
+{
+#ifdef CONFIG_COMPAT
+    return in_compat_syscall() && !COMPAT_USE_64BIT_TIME;
+#else
+    return false;
+#endif
+}
+
+static size_t vinput_event_size(void)
+{
+#ifdef CONFIG_COMPAT
+    if (vinput_compat_events())
+        return sizeof(struct vinput_compat_event);
+#endif
+    return sizeof(struct input_event);
+}
+
+/*
+ * Copy n records of the caller's layout into events. Compat records are
+ * smaller, so they are converted in place from the last one, which never
+ * overwrites a record still to convert.
+ */
+static int vinput_events_from_user(struct input_event *events,
+                                   const char __user *buffer,
+                                   int n)
+{
+#ifdef CONFIG_COMPAT
+    struct vinput_compat_event cev;
+
+    if (vinput_compat_events()) {
+        if (copy_from_user(events, buffer, n * sizeof(cev)))
+            return -EFAULT;
+        while (n--) {
+            memcpy(&cev, (void *) events + n * sizeof(cev), sizeof(cev));
+            events[n].input_event_sec = cev.sec;
+            events[n].input_event_usec = cev.usec;
+            events[n].type = cev.type;
+            events[n].code = cev.code;
+            events[n].value = cev.value;
+        }
+        return 0;
+    }
+#endif
+    if (copy_from_user(events, buffer, n * sizeof(struct input_event)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Whether the time of a record is well formed, usec within a second */
+static bool vinput_event_time_valid(const struct input_event *ev)
+{
+    return (u64) ev->input_event_usec < USEC_PER_SEC;
+}
+
+static u64 vinput_event_time(const struct input_event *ev)
+{
+    return (u64) ev->input_event_sec * NSEC_PER_SEC +
+           (u64) ev->input_event_usec * NSEC_PER_USEC;
+}
+
+/*
+ * Add a binary record to the frame in progress, and submit the frame when
+ * the record is a SYN_REPORT, stamped with its time when it is set. Returns
+ * -EINVAL for records the device does not support or that overflow the
+ * frame, which are counted as rejected.
+ */
+static int vinput_stage_event(struct vinput_file *vfile,
+                              unsigned int type,
+                              unsigned int code,
+                              int value,
+                              u64 time)
+{
+    struct vinput_frame *frame;
+    struct vinput *vinput = vfile->vinput;
+    bool sync = type == EV_SYN && code == SYN_REPORT;
+
+    if (!vinput_event_supported(vinput->input, type, code) ||
+        (!sync && vfile->staged == VINPUT_FRAME_MAX_EVENTS)) {
+        this_cpu_inc(vinput->stats->rejected);
+        return -EINVAL;
+    }
+
+    if (!sync) {
+        vfile->stage[vfile->staged++] = (struct input_value){
+            .type = type,
+            .code = code,
+            .value = value,
+        };
+        return 0;
+    }
+
+    frame = vinput_frame_alloc(vfile->staged, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+    memcpy(frame->events, vfile->stage,
+           vfile->staged * sizeof(struct input_value));
+    frame->count = vfile->staged;
+    frame->timestamp = ns_to_ktime(time);
+    vfile->staged = 0;
+    vinput_frame_submit(vinput, frame);
+
+    return 0;
+}
+
+/* Stage a binary record, refusing a malformed time */
+static int vinput_stage_record(struct vinput_file *vfile,
+                               const struct input_event *ev)
+{
+    if (!vinput_event_time_valid(ev)) {
+        this_cpu_inc(vfile->vinput->stats->rejected);
+        return -EINVAL;
+    }
+
+    return vinput_stage_event(vfile, ev->type, ev->code, ev->value,
+                              vinput_event_time(ev));
+}
+
+static int vinput_set_mode(struct vinput_file *vfile, int mode)
+{
+    int err = 0;
+    struct input_event *events = NULL;
+
+    if (mode != VINPUT_MODE_TEXT && mode != VINPUT_MODE_BINARY)
+        return -EINVAL;
+
+    if (mode == VINPUT_MODE_BINARY) {
+        events = kmalloc_array(VINPUT_BATCH, sizeof(struct input_event),
+                               GFP_KERNEL);
+        if (!events)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&vfile->lock);
+    if (mode == VINPUT_MODE_BINARY)
+        err = vinput_stage_alloc(vfile);
+    if (err) {
+        mutex_unlock(&vfile->lock);
+        kfree(events);
+        return err;
+    }
+    swap(vfile->events, events);
+    vfile->mode = mode;
+    vfile->line_len = 0;
+    vfile->overflow = false;
+    mutex_unlock(&vfile->lock);
+
+    kfree(events);
+
+    return 0;
+}
+
+/*
+ * Consume the ring up to the head published by userspace. Records are read
+ * field by field into a local copy so that userspace cannot change them
+ * between validation and emission, and staged into frames like binary
+ * writes.
+ * Draining stops at a frame that cannot be allocated, to be retried later.
+ * Called with vfile->lock held.
+ */
+static int vinput_ring_drain(struct vinput_file *vfile)
+{
+    int idx;
+    int err = 0;
+    int n = 0;
+    u32 head, tail;
+    struct input_event *ev, rec;
+    struct vinput *vinput = vfile->vinput;
+    struct vinput_ring_buf *ring = vfile->ring;
+
+    if (!vinput_enter(vinput, &idx))
+        return -ENODEV;
+
+    tail = ring->tail;
+    head = smp_load_acquire(&ring->hdr->head);
+    if (head - tail > ring->mask + 1) {
+        vinput_leave(idx);
+        dev_warn_ratelimited(&vinput->dev, "Corrupted ring head %u\n", head);
+        return -EINVAL;
+    }
+
+    for (; tail != head; tail++, n++) {
+        ev = &ring->events[tail & ring->mask];
+        rec.input_event_sec = READ_ONCE(ev->input_event_sec);
+        rec.input_event_usec = READ_ONCE(ev->input_event_usec);
+        rec.type = READ_ONCE(ev->type);
+        rec.code = READ_ONCE(ev->code);
+        rec.value = READ_ONCE(ev->value);
+
+        err = vinput_stage_record(vfile, &rec);
+        if (err == -ENOMEM)
+            break;
+        if (err)
+            WRITE_ONCE(ring->hdr->rejected, ring->hdr->rejected + 1);
+    }
+
+    ring->tail = tail;
+    smp_store_release(&ring->hdr->tail, tail);
+    vinput_leave(idx);
+
+    return n ? n : (err == -ENOMEM ? err : 0);
+}
+
+/*
+ * Adaptive polling consumer: drain as long as records keep coming, then
+ * back off exponentially from VINPUT_RING_MIN_SLEEP_US to
+ * VINPUT_RING_MAX_SLEEP_US while the ring stays empty.
+ */
+static int vinput_ring_thread(void *data)
+{
+    int n;
+    unsigned int delay = VINPUT_RING_MIN_SLEEP_US;
+    struct vinput_file *vfile = data;
+
+    while (!kthread_should_stop()) {
+        mutex_lock(&vfile->lock);
+        n = vinput_ring_drain(vfile);
+        mutex_unlock(&vfile->lock);
+
+        if (n > 0) {
+            delay = VINPUT_RING_MIN_SLEEP_US;
+            cond_resched();
+            continue;
+        }
+
+        usleep_range(delay, delay * 2);
+        delay = min_t(unsigned int, delay * 2, VINPUT_RING_MAX_SLEEP_US);
+    }
+
+    return 0;
+}
+
+static int vinput_ring_setup(struct vinput_file *vfile,
+                             struct vinput_ring_setup *setup)
+{
+    int err = 0;
+    struct vinput_ring_buf *ring;
+
+    if (vinput_compat_events() || !is_power_of_2(setup->entries) ||
+        setup->entries > VINPUT_RING_MAX_ENTRIES ||
+        setup->flags & ~VINPUT_RING_POLL)
+        return -EINVAL;
+
+    ring = kzalloc(sizeof(struct vinput_ring_buf), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->size = PAGE_ALIGN(PAGE_SIZE +
+                            setup->entries * sizeof(struct input_event));
+    ring->hdr = vmalloc_user(ring->size);
+    if (!ring->hdr) {
+        err = -ENOMEM;
+        goto fail_alloc;
+    }
+
+    ring->mask = setup->entries - 1;
+    ring->events = (void *) ring->hdr + PAGE_SIZE;
+    ring->hdr->entries = setup->entries;
+    ring->hdr->flags = setup->flags;
+    ring->hdr->offset = PAGE_SIZE;
+
+    mutex_lock(&vfile->lock);
+    /* the ring takes the stage over, not in the middle of a frame */
+    err = vfile->ring || vfile->staged ? -EBUSY : vinput_stage_alloc(vfile);
+    if (err) {
+        mutex_unlock(&vfile->lock);
+        goto fail_busy;
+    }
+    vfile->ring = ring;
+    mutex_unlock(&vfile->lock);
+
+    if (setup->flags & VINPUT_RING_POLL) {
+        ring->thread = kthread_run(vinput_ring_thread, vfile, "vinput%ld-ring",
+                                   vfile->vinput->id);
+        if (IS_ERR(ring->thread)) {
+            err = PTR_ERR(ring->thread);
+            ring->thread = NULL;
+            ring->hdr->flags &= ~VINPUT_RING_POLL;
+        }
+    }
+
+    return err;
+
+fail_busy:
+    vfree(ring->hdr);
+fail_alloc:
+    kfree(ring);
+    return err;
+}
+
+static void vinput_ring_free(struct vinput_ring_buf *ring)
+{
+    if (ring->thread)
+        kthread_stop(ring->thread);
+    vfree(ring->hdr);
+    kfree(ring);
+}
+
+static int vinput_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int err;
+    struct vinput_file *vfile = file->private_data;
+
+    mutex_lock(&vfile->lock);
+    if (vfile->ring)
+        err = remap_vmalloc_range(vma, vfile->ring->hdr, vma->vm_pgoff);
+    else
+        err = -ENXIO;
+    mutex_unlock(&vfile->lock);
+
+    return err;
+}
+
+static struct vinput_frame *vinput_replay_next(struct vinput_player *player,
+                                               u64 *when)
+{
+    struct vinput_replay_buf *replay =
+        container_of(player, struct vinput_replay_buf, player);
+
+    if (replay->next == replay->count)
+        return NULL;
+
+    *when = replay->offsets[replay->next];
+    return replay->frames[replay->next++];
+}
+
+static void vinput_replay_free(struct vinput_replay_buf *replay)
+{
+    vinput_player_stop(&replay->player);
+    while (replay->next < replay->count)
+        kfree(replay->frames[replay->next++]);
+    kvfree(replay->frames);
+    kvfree(replay->offsets);
+    kfree(replay);
+}
+
+/*
+ * Split a trace into frames at its SYN_REPORT records, each scheduled at
+ * the time of its SYN_REPORT relative to the first record. Schedules never
+ * go backwards, and records after the last SYN_REPORT are ignored.
+ */
+static int vinput_replay_build(struct vinput_replay_buf *replay,
+                               struct input_dev *input,
+                               const struct input_event *events,
+                               unsigned int count)
+{
+    unsigned int i;
+    unsigned int n = 0;
+    unsigned int first = 0;
+    u64 start, time;
+    u64 last = 0;
+    struct vinput_frame *frame;
+
+    for (i = 0; i < count; i++) {
+        if (!vinput_event_supported(input, events[i].type, events[i].code) ||
+            !vinput_event_time_valid(&events[i]))
+            return -EINVAL;
+        n += events[i].type == EV_SYN && events[i].code == SYN_REPORT;
+    }
+
+    replay->frames = kvmalloc_array(n, sizeof(*replay->frames), GFP_KERNEL);
+    replay->offsets = kvmalloc_array(n, sizeof(*replay->offsets), GFP_KERNEL);
+    if (!replay->frames || !replay->offsets)
+        return -ENOMEM;
+
+    start = vinput_event_time(&events[0]);
+    for (i = 0; i < count; i++) {
+        if (events[i].type != EV_SYN || events[i].code != SYN_REPORT)
+            continue;
+        if (i - first > VINPUT_FRAME_MAX_EVENTS)
+            return -E2BIG;
+
+        frame = vinput_frame_alloc(i - first, GFP_KERNEL);
+        if (!frame)
+            return -ENOMEM;
+        for (; first < i; first++)
+            vinput_frame_add(frame, events[first].type, events[first].code,
+                             events[first].value);
+        first = i + 1;
+
+        time = vinput_event_time(&events[i]);
+        last = max(last, time > start ? time - start : 0);
+        replay->offsets[replay->count] = last;
+        replay->frames[replay->count++] = frame;
+    }
+
+    return 0;
+}
+
+static int vinput_replay_start(struct vinput_file *vfile,
+                               struct vinput_replay *args)
+{
+    int idx;
+    int err;
+    struct input_event *events;
+    struct vinput_replay_buf *replay;
+
+    if (vinput_compat_events() || !args->count ||
+        args->count > VINPUT_REPLAY_MAX_EVENTS ||
+        args->flags & ~VINPUT_REPLAY_TIMESTAMP)
+        return -EINVAL;
+
+    events = kvmalloc_array(args->count, sizeof(*events), GFP_KERNEL);
+    replay = kzalloc(sizeof(*replay), GFP_KERNEL);
+    if (!events || !replay) {
+        kfree(replay);
+        err = -ENOMEM;
+        goto out;
+    }
+    vinput_player_init(&replay->player, vfile->vinput, vinput_replay_next);
+
+    /* the trace is checked against the input device, keep it alive */
+    if (copy_from_user(events, u64_to_user_ptr(args->events),
+                       args->count * sizeof(*events))) {
+        err = -EFAULT;
+    } else if (!vinput_enter(vfile->vinput, &idx)) {
+        err = -ENODEV;
+    } else {
+        err = vinput_replay_build(replay, vfile->vinput->input, events,
+                                  args->count);
+        vinput_leave(idx);
+    }
+    if (err) {
+        vinput_replay_free(replay);
+        goto out;
+    }
+
+    mutex_lock(&vfile->lock);
+    if (vfile->replay && READ_ONCE(vfile->replay->player.running)) {
+        err = -EBUSY;
+    } else {
+        swap(vfile->replay, replay);
+        vfile->replay->player.stamp = args->flags & VINPUT_REPLAY_TIMESTAMP;
+        vinput_player_start(&vfile->replay->player, args->speed);
+    }
+    mutex_unlock(&vfile->lock);
+
+    if (replay)
+        vinput_replay_free(replay);
+out:
+    kvfree(events);
+    return err;
+}
+
+static int vinput_replay_status(struct vinput_file *vfile,
+                                struct vinput_replay_status *status)
+{
+    struct vinput_player *player;
+
+    memset(status, 0, sizeof(*status));
+
+    mutex_lock(&vfile->lock);
+    if (!vfile->replay) {
+        mutex_unlock(&vfile->lock);
+        return -ENXIO;
+    }
+    player = &vfile->replay->player;
+    status->frames = vfile->replay->count;
+    status->played = READ_ONCE(player->played);
+    status->running = READ_ONCE(player->running);
+    status->late_max_ns = READ_ONCE(player->late_max);
+    status->late_sum_ns = READ_ONCE(player->late_sum);
+    mutex_unlock(&vfile->lock);
+
+    return 0;
+}
+
+/*
+ * Macros: named sequences of frames uploaded through the macros attribute
+ * and played by a per device player when a "@name" command is written.
+ * Each is compiled once into an array of events and an array of steps, a
+ * step being a frame with its offset from the start of the macro. Triggers
+ * are queued and their macros played back to back.
+ */
+#define VINPUT_MACRO_NAME 32
+#define VINPUT_MACRO_MAX 64
+#define VINPUT_MACRO_MAX_EVENTS 4096
+#define VINPUT_MACRO_QUEUE 16
+
+struct vinput_macro_step {
+    u64 when;
+    u32 first;
+    u32 count;
+};
+
+struct vinput_macro {
+    struct list_head list;
+    char name[VINPUT_MACRO_NAME];
+    /* offset of the end of the macro, trailing delay included */
+    u64 length;
+    unsigned int count;
+    unsigned int steps;
+    struct vinput_macro_step *step;
+    struct input_value events[];
+};
+
+struct vinput_macros {
+    /* serializes uploads and triggers */
+    struct mutex lock;
+    struct list_head list;
+    unsigned int count;
+
+    /* triggered macros, the one at head being played */
+    spinlock_t queue_lock;
+    struct vinput_macro *queue[VINPUT_MACRO_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int step;
+    u64 base;
+    bool idle;
+    struct vinput_player player;
+};
+
+static struct vinput_frame *vinput_macro_next(struct vinput_player *player,
+                                              u64 *when)
+{
+    unsigned int i;
+    struct input_value *ev;
+    struct vinput_macro *macro;
+    struct vinput_macro_step *step;
+    struct vinput_frame *frame = NULL;
+    struct vinput_macros *macros =
+        container_of(player, struct vinput_macros, player);
+
+    spin_lock(&macros->queue_lock);
+    while (macros->head != macros->tail) {
+        macro = macros->queue[macros->head % VINPUT_MACRO_QUEUE];
+        if (macros->step == macro->steps) {
+            macros->base += macro->length;
+            macros->step = 0;
+            macros->head++;
+            continue;
+        }
+
+        step = &macro->step[macros->step++];
+        frame = vinput_frame_alloc(step->count, GFP_ATOMIC);
+        if (!frame)
+            break;
+        for (i = 0; i < step->count; i++) {
+            ev = &macro->events[step->first + i];
+            vinput_frame_add(frame, ev->type, ev->code, ev->value);
+        }
+        *when = macros->base + step->when;
+        break;
+    }
+    if (!frame) {
+        /* out of memory drops the pending triggers */
+        macros->head = macros->tail;
+        macros->step = 0;
+        macros->idle = true;
+    }
+    spin_unlock(&macros->queue_lock);
+
+    return frame;
+}
+
+static struct vinput_macros *vinput_macros_alloc(struct vinput *vinput)
+{
+    struct vinput_macros *macros = kzalloc(sizeof(*macros), GFP_KERNEL);
+
+    if (!macros)
+        return NULL;
+
+    mutex_init(&macros->lock);
+    INIT_LIST_HEAD(&macros->list);
+    spin_lock_init(&macros->queue_lock);
+    macros->idle = true;
+    vinput_player_init(&macros->player, vinput, vinput_macro_next);
+
+    return macros;
+}
+
+/*
+ * Drop the pending triggers of macro, under macros->lock. The player is
+ * only stopped when macro is the one being played, and then restarted on
+ * the triggers left, from the start of the next macro.
+ */
+static void vinput_macro_cancel(struct vinput_macros *macros,
+                                struct vinput_macro *macro)
+{
+    unsigned int i, n;
+    bool playing;
+    struct vinput_macro *queued;
+
+    spin_lock_bh(&macros->queue_lock);
+    playing = macros->head != macros->tail &&
+              macros->queue[macros->head % VINPUT_MACRO_QUEUE] == macro;
+    spin_unlock_bh(&macros->queue_lock);
+
+    if (playing)
+        vinput_player_stop(&macros->player);
+
+    spin_lock_bh(&macros->queue_lock);
+    if (playing) {
+        macros->step = 0;
+        macros->base = 0;
+    }
+    for (i = n = macros->head; i != macros->tail; i++) {
+        queued = macros->queue[i % VINPUT_MACRO_QUEUE];
+        if (queued != macro)
+            macros->queue[n++ % VINPUT_MACRO_QUEUE] = queued;
+    }
+    macros->tail = n;
+    if (playing)
+        macros->idle = macros->head == macros->tail;
+    playing = playing && !macros->idle;
+    spin_unlock_bh(&macros->queue_lock);
+
+    if (playing)
+        vinput_player_start(&macros->player, 1000);
+}
+
+static void vinput_macros_free(struct vinput_macros *macros)
+{
+    struct vinput_macro *macro, *next;
+
+    vinput_player_stop(&macros->player);
+    list_for_each_entry_safe (macro, next, &macros->list, list)
+        kvfree(macro);
+    kfree(macros);
+}
+
+static struct vinput_macro *vinput_macro_find(struct vinput_macros *macros,
+                                              const char *name)
+{
+    struct vinput_macro *macro;
+
+    list_for_each_entry (macro, &macros->list, list) {
+        if (!strcmp(macro->name, name))
+            return macro;
+    }
+
+    return NULL;
+}
+
+/*
+ * Compile a macro from records of type,code,value separated by ';'. A
+ * SYN_REPORT record ends a frame, its value being the delay in ms before
+ * the next one. The command is parsed twice, to size the macro then to
+ * fill it.
+ */
+static struct vinput_macro *vinput_macro_compile(struct vinput *vinput,
+                                                 const char *buff,
+                                                 int len)
+{
+    int vals[3];
+    int pass;
+    u64 when;
+    unsigned int n, count, steps;
+    struct vinput_parser p;
+    struct vinput_macro *macro = NULL;
+
+    for (pass = 0; pass < 2; pass++) {
+        n = 0;
+        count = 0;
+        steps = 0;
+        when = 0;
+
+        vinput_parser_init(&p, buff, len);
+        do {
+            if (vinput_parse_fields(&p, vals, 3))
+                break;
+
+            if (vals[0] == EV_SYN && vals[1] == SYN_REPORT) {
+                if (vals[2] < 0)
+                    vinput_parser_fail(&p, -EINVAL);
+                when += (u64) vals[2] * NSEC_PER_MSEC;
+                n = 0;
+                continue;
+            }
+
+            if (!vinput_event_supported(vinput->input, vals[0], vals[1]) ||
+                n == VINPUT_FRAME_MAX_EVENTS ||
+                count == VINPUT_MACRO_MAX_EVENTS) {
+                vinput_parser_fail(&p, -EINVAL);
+                break;
+            }
+
+            if (!n) {
+                if (macro)
+                    macro->step[steps] = (struct vinput_macro_step){
+                        .when = when,
+                        .first = count,
+                    };
+                steps++;
+            }
+            if (macro) {
+                macro->events[count] = (struct input_value){
+                    .type = vals[0],
+                    .code = vals[1],
+                    .value = vals[2],
+                };
+                macro->step[steps - 1].count++;
+            }
+            n++;
+            count++;
+        } while (vinput_parse_next(&p));
+
+        if (vinput_parse_end(&p)) {
+            vinput_parser_error(vinput, &p);
+            kvfree(macro);
+            return ERR_PTR(p.err);
+        }
+
+        if (!macro) {
+            macro = kvzalloc(struct_size(macro, events, count) +
+                                 steps * sizeof(*macro->step),
+                             GFP_KERNEL);
+            if (!macro)
+                return ERR_PTR(-ENOMEM);
+            macro->step = (struct vinput_macro_step *) &macro->events[count];
+        }
+    }
+
+    macro->length = when;
+    macro->count = count;
+    macro->steps = steps;
+
+    return macro;
+}
+
+/* Define the macro name from def, or delete it when def is NULL */
+static int vinput_macro_set(struct vinput *vinput,
+                            const char *name,
+                            const char *def)
+{
+    int err = 0;
+    struct vinput_macro *old;
+    struct vinput_macro *macro = NULL;
+    struct vinput_macros *macros = vinput->macros;
+
+    if (!*name || strlen(name) >= VINPUT_MACRO_NAME)
+        return -EINVAL;
+
+    if (def) {
+        macro = vinput_macro_compile(vinput, def, strlen(def));
+        if (IS_ERR(macro))
+            return PTR_ERR(macro);
+        strscpy(macro->name, name, sizeof(macro->name));
+    }
+
+    mutex_lock(&macros->lock);
+    old = vinput_macro_find(macros, name);
+    if (old) {
+        /* pending triggers may refer to it */
+        vinput_macro_cancel(macros, old);
+        list_del(&old->list);
+        macros->count--;
+    } else if (!macro) {
+        err = -ENOENT;
+    }
+
+    if (macro && macros->count == VINPUT_MACRO_MAX) {
+        err = -ENOSPC;
+    } else if (macro) {
+        list_add_tail(&macro->list, &macros->list);
+        macros->count++;
+        macro = NULL;
+    }
+    mutex_unlock(&macros->lock);
+
+    kvfree(old);
+    kvfree(macro);
+
+    return err;
+}
+
+/* Queue the macro name for playing, on a "@name" command */
+static int vinput_macro_trigger(struct vinput *vinput, const char *name)
+{
+    int err = 0;
+    bool start = false;
+    struct vinput_macro *macro;
+    struct vinput_macros *macros = vinput->macros;
+
+    mutex_lock(&macros->lock);
+    macro = vinput_macro_find(macros, name);
+    if (!macro) {
+        err = -ENOENT;
+        goto out;
+    }
+
+    spin_lock_bh(&macros->queue_lock);
+    if (macros->tail - macros->head == VINPUT_MACRO_QUEUE) {
+        err = -EAGAIN;
+    } else {
+        macros->queue[macros->tail++ % VINPUT_MACRO_QUEUE] = macro;
+        start = macros->idle;
+        if (start) {
+            macros->idle = false;
+            macros->base = 0;
+        }
+    }
+    spin_unlock_bh(&macros->queue_lock);
+
+    if (start)
+        vinput_player_start(&macros->player, 1000);
+out:
+    mutex_unlock(&macros->lock);
+
+    return err;
+}
+
+/* Readback of the last command, for devices without a capture ring */
+static ssize_t vinput_read_last(struct vinput_file *vfile,
+                                char __user *buffer,
+                                size_t count,
+                                loff_t *offset)
+{
+    int idx;
+    int len;
+    char buff[VINPUT_MAX_LEN + 1];
+    struct vinput *vinput = vfile->vinput;
+
+    if (!vinput->type->ops->read)
+        return 0;
+    if (!vinput_enter(vinput, &idx))
+        return -ENODEV;
+    len = vinput->type->ops->read(vinput, buff, sizeof(buff));
+    vinput_leave(idx);
+
+    if (len < 0)
+        return len;
+    len = min_t(int, len, sizeof(buff) - 1);
+    if (*offset >= len)
+        return 0;
+
+    count = min_t(size_t, count, len - *offset);
+    if (copy_to_user(buffer, buff + *offset, count))
+        return -EFAULT;
+    *offset += count;
+
+    return count;
+}
+
+static bool vinput_capture_ready(struct vinput_file *vfile)
+{
+    bool ready;
+    struct vinput *vinput = vfile->vinput;
+
+    spin_lock_irq(&vinput->capture_lock);
+    ready = vfile->cursor != vinput->capture_head;
+    spin_unlock_irq(&vinput->capture_lock);
+
+    return ready || READ_ONCE(vinput->dead);
+}
+
+/*
+ * Take up to n records from the capture ring. Records lost to the writer
+ * are replaced by a single SYN_DROPPED record holding their count.
+ */
+static int vinput_capture_take(struct vinput_file *vfile,
+                               struct vinput_record *recs,
+                               int n)
+{
+    int i = 0;
+    u64 lost;
+    struct vinput *vinput = vfile->vinput;
+
+    spin_lock_irq(&vinput->capture_lock);
+    if (vfile->cursor < vinput->capture_tail) {
+        lost = vinput->capture_tail - vfile->cursor;
+        vfile->cursor = vinput->capture_tail;
+        this_cpu_add(vinput->stats->dropped, lost);
+
+        recs[i].time = ktime_get_ns();
+        recs[i++].v = (struct input_value){
+            .type = EV_SYN,
+            .code = SYN_DROPPED,
+            .value = min_t(u64, lost, INT_MAX),
+        };
+    }
+    for (; i < n && vfile->cursor != vinput->capture_head; i++)
+        recs[i] = vinput->capture[vfile->cursor++ &
+                                  (vinput->capture_size - 1)];
+    spin_unlock_irq(&vinput->capture_lock);
+
+    return i;
+}
+
+static int vinput_format_record(char *buff, struct vinput_record *rec)
+{
+    u32 nsec;
+    u64 sec = div_u64_rem(rec->time, NSEC_PER_SEC, &nsec);
+
+    return scnprintf(buff, VINPUT_CAPTURE_LINE, "%llu.%06u %u %u %d\n", sec,
+                     nsec / NSEC_PER_USEC, rec->v.type, rec->v.code,
+                     rec->v.value);
+}
+
+static void vinput_record_event(struct input_event *ev,
+                                const struct vinput_record *rec)
+{
+    u32 nsec;
+
+    ev->input_event_sec = div_u64_rem(rec->time, NSEC_PER_SEC, &nsec);
+    ev->input_event_usec = nsec / NSEC_PER_USEC;
+    ev->type = rec->v.type;
+    ev->code = rec->v.code;
+    ev->value = rec->v.value;
+}
+
+/* Lay rec out in buff as a binary record of the caller, return its size */
+static size_t vinput_record_binary(char *buff, const struct vinput_record *rec)
+{
+    struct input_event ev;
+#ifdef CONFIG_COMPAT
+    struct vinput_compat_event cev;
+#endif
+
+    vinput_record_event(&ev, rec);
+#ifdef CONFIG_COMPAT
+    if (vinput_compat_events()) {
+        cev.sec = ev.input_event_sec;
+        cev.usec = ev.input_event_usec;
+        cev.type = ev.type;
+        cev.code = ev.code;
+        cev.value = ev.value;
+        memcpy(buff, &cev, sizeof(cev));
+        return sizeof(cev);
+    }
+#endif
+    memcpy(buff, &ev, sizeof(ev));
+    return sizeof(ev);
+}
+
+/*
+ * Read the capture ring: struct input_event records in binary mode, one
+ * "sec.usec type code value" line per record in text mode. Blocks until a
+ * record is available unless the file is non-blocking, and returns 0 once
+ * the device is gone.
+ */
+
+static ssize_t vinput_read_capture(struct file *file,
+                                   char __user *buffer,
+                                   size_t count)
+{
+    int i, n;
+    int err;
+    size_t len;
+    size_t size;
+    size_t done = 0;
+    bool binary;
+    struct vinput_file *vfile = file->private_data;
+    struct vinput *vinput = vfile->vinput;
+    struct vinput_record *recs;
+    char *line;
+
+    mutex_lock(&vfile->lock);
+    binary = vfile->mode == VINPUT_MODE_BINARY;
+    mutex_unlock(&vfile->lock);
+    size = binary ? vinput_event_size() : VINPUT_CAPTURE_LINE;
+
+    if (count < size)
+        return -EINVAL;
+
+    if (!vinput_capture_ready(vfile)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        err = wait_event_interruptible(vinput->capture_wait,
+                                       vinput_capture_ready(vfile));
+        if (err)
+            return err;
+    }
+
+    recs = kmalloc_array(VINPUT_CAPTURE_BATCH, sizeof(*recs), GFP_KERNEL);
+    line = kmalloc(VINPUT_CAPTURE_LINE, GFP_KERNEL);
+    if (!recs || !line) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    err = 0;
+    mutex_lock(&vfile->lock);
+    while (done + size <= count) {
+        n = min_t(size_t, (count - done) / size, VINPUT_CAPTURE_BATCH);
+        n = vinput_capture_take(vfile, recs, n);
+        if (!n)
+            break;
+
+        for (i = 0; i < n; i++) {
+            if (binary)
+                len = vinput_record_binary(line, &recs[i]);
+            else
+                len = vinput_format_record(line, &recs[i]);
+            if (copy_to_user(buffer + done, line, len)) {
+                err = -EFAULT;
+                break;
+            }
+            done += len;
+        }
+        if (err)
+            break;
+    }
+    mutex_unlock(&vfile->lock);
+
+out:
+    kfree(line);
+    kfree(recs);
+
+    return done ? done : err;
+}
+
+static ssize_t vinput_read(struct file *file,
+                           char __user *buffer,
+                           size_t count,
+                           loff_t *offset)
+{
+    struct vinput_file *vfile = file->private_data;
+
+    if (!READ_ONCE(vfile->vinput->capture_size))
+        return vinput_read_last(vfile, buffer, count, offset);
+    return vinput_read_capture(file, buffer, count);
+}
+
+static __poll_t vinput_poll(struct file *file, poll_table *wait)
+{
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    struct vinput_file *vfile = file->private_data;
+    struct vinput *vinput = vfile->vinput;
+
+    poll_wait(file, &vinput->capture_wait, wait);
+
+    if (READ_ONCE(vinput->dead))
+        return EPOLLHUP | EPOLLERR;
+    if (!READ_ONCE(vinput->capture_size) || vinput_capture_ready(vfile))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+/*
+ * Stage n binary records, up to the first invalid one. Returns the number
+ * of records staged, with the error that stopped them in *err.
+ */
+static int vinput_stage_events(struct vinput_file *vfile,
+                               const struct input_event *events,
+                               int n,
+                               int *err)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        *err = vinput_stage_record(vfile, &events[i]);
+        if (*err)
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * Binary mode: the buffer is an array of struct input_event. Records are
+ * copied and validated VINPUT_BATCH at a time, and staged up to the first
+ * invalid one. A partial write is returned when some records were staged.
+ */
+static ssize_t vinput_write_events(struct vinput_file *vfile,
+                                   const char __user *buffer,
+                                   size_t count)
+{
+    int i, n;
+    int err = 0;
+    size_t done = 0;
+    size_t size = vinput_event_size();
+    struct input_event *events = vfile->events;
+
+    if (count % size)
+        return -EINVAL;
+
+    while (done < count) {
+        n = min_t(size_t, (count - done) / size, VINPUT_BATCH);
+
+        err = vinput_events_from_user(events, buffer + done, n);
+        if (err)
+            break;
+
+        i = vinput_stage_events(vfile, events, n, &err);
+        done += i * size;
+        if (err)
+            break;
+    }
+
+    return done ? done : err;
+}
+
+/* Hand the pending line to the send op of the device and reset it */
+static int vinput_send_line(struct vinput_file *vfile)
+{
+    int ret;
+    int len = vfile->line_len;
+    struct vinput *vinput = vfile->vinput;
+
+    vfile->line_len = 0;
+
+    if (vfile->overflow) {
+        vfile->overflow = false;
+        vinput_parse_error(vinput, vfile->line, len, len, -EINVAL);
+        dev_warn_ratelimited(&vinput->dev,
+                             "Too long. %d bytes allowed per line\n",
+                             VINPUT_MAX_LEN);
+        return -EINVAL;
+    }
+
+    if (!len)
+        return 0;
+
+    vfile->line[len] = '\0';
+    if (vfile->line[0] == '@')
+        ret = vinput_macro_trigger(vinput, vfile->line + 1);
+    else
+        ret = vinput->type->ops->send(vinput, vfile->line, len);
+
+    return ret < 0 ? ret : 0;
+}
+
+static void vinput_append_line(struct vinput_file *vfile,
+                               const char *buff,
+                               size_t len)
+{
+    size_t room = VINPUT_MAX_LEN - vfile->line_len;
+
+    if (len > room) {
+        vfile->overflow = true;
+        len = room;
+    }
+
+    memcpy(vfile->line + vfile->line_len, buff, len);
+    vfile->line_len += len;
+}
+
+/*
+ * Append n bytes of text to the pending line, sending each line completed.
+ * Returns the error of the first line failing, and the bytes up to the end
+ * of the last line sent in *sent, untouched when none was.
+ */
+static int vinput_write_lines(struct vinput_file *vfile,
+                              const char *buff,
+                              size_t n,
+                              size_t *sent)
+{
+    int err;
+    const char *pos, *eol;
+    const char *end = buff + n;
+
+    for (pos = buff; pos < end; pos = eol + 1) {
+        eol = memchr(pos, '\n', end - pos);
+        vinput_append_line(vfile, pos, (eol ? eol : end) - pos);
+        if (!eol)
+            break;
+
+        err = vinput_send_line(vfile);
+        if (err)
+            return err;
+        *sent = eol + 1 - buff;
+    }
+
+    return 0;
+}
+
+/*
+ * Text mode: the buffer is split on newlines and the send op of the device
+ * is called once per complete line. An incomplete trailing line is kept for
+ * the next write, or sent when the file is released. When a line fails, the
+ * bytes preceding it are reported as written, otherwise the error is.
+ */
+static ssize_t vinput_write_text(struct vinput_file *vfile,
+                                 const char __user *buffer,
+                                 size_t count)
+{
+    int err = 0;
+    size_t n, sent;
+    size_t done = 0;
+    size_t start = 0;
+    char buff[VINPUT_MAX_LEN];
+
+    while (done < count) {
+        n = min_t(size_t, count - done, VINPUT_MAX_LEN);
+        if (copy_from_user(buff, buffer + done, n)) {
+            err = -EFAULT;
+            break;
+        }
+
+        sent = 0;
+        err = vinput_write_lines(vfile, buff, n, &sent);
+        if (sent)
+            start = done + sent;
+        if (err)
+            break;
+        done += n;
+    }
+
+    if (err)
+        return start ? start : err;
+    return count;
+}
+
+/* Free the state of a file and put its device */
+static void vinput_file_free(struct vinput_file *vfile)
+{
+    if (vfile->ring)
+        vinput_ring_free(vfile->ring);
+    if (vfile->replay)
+        vinput_replay_free(vfile->replay);
+    put_device(&vfile->vinput->dev);
+    kfree(vfile->stage);
+    kfree(vfile->events);
+    kfree(vfile);
+}
+
+static int vinput_release(struct inode *inode, struct file *file)
+{
+    int idx;
+    struct vinput_file *vfile = file->private_data;
+
+    if (vfile->mode == VINPUT_MODE_TEXT &&
+        (vfile->line_len || vfile->overflow) &&
+        vinput_enter(vfile->vinput, &idx)) {
+        vinput_send_line(vfile);
+        vinput_leave(idx);
+    }
+
+    vinput_file_free(vfile);
+
+    return 0;
+}
+
+/* Account a write to vinput, of ret bytes or failed */
+static void vinput_account_write(struct vinput *vinput, ssize_t ret)
+{
+    this_cpu_inc(vinput->stats->writes);
+    if (ret > 0)
+        this_cpu_add(vinput->stats->bytes, ret);
+}
+
+static ssize_t vinput_write(struct file *file,
+                            const char __user *buffer,
+                            size_t count,
+                            loff_t *offset)
+{
+    int idx;
+    ssize_t ret;
+    struct vinput_file *vfile = file->private_data;
+    struct vinput *vinput = vfile->vinput;
+
+    if (!vinput_enter(vinput, &idx))
+        return -ENODEV;
+
+    mutex_lock(&vfile->lock);
+    if (vfile->ring)
+        ret = -EBUSY;
+    else if (vfile->mode == VINPUT_MODE_BINARY)
+        ret = vinput_write_events(vfile, buffer, count);
+    else
+        ret = vinput_write_text(vfile, buffer, count);
+    mutex_unlock(&vfile->lock);
+
+    vinput_account_write(vinput, ret);
+    vinput_leave(idx);
+
+    return ret;
+}
+
+static long vinput_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int mode;
+    int ret;
+    struct vinput_ring_setup setup;
+    struct vinput_replay replay;
+    struct vinput_replay_status status;
+    struct vinput_file *vfile = file->private_data;
+
+    switch (cmd) {
+    case VINPUT_IOCTL_SET_MODE:
+        if (get_user(mode, (int __user *) arg))
+            return -EFAULT;
+        return vinput_set_mode(vfile, mode);
+    case VINPUT_IOCTL_GET_MODE:
+        mutex_lock(&vfile->lock);
+        mode = vfile->mode;
+        mutex_unlock(&vfile->lock);
+        return put_user(mode, (int __user *) arg);
+    case VINPUT_IOCTL_RING_SETUP:
+        if (copy_from_user(&setup, (void __user *) arg, sizeof(setup)))
+            return -EFAULT;
+        return vinput_ring_setup(vfile, &setup);
+    case VINPUT_IOCTL_RING_KICK:
+        mutex_lock(&vfile->lock);
+        ret = vfile->ring ? vinput_ring_drain(vfile) : -ENXIO;
+        mutex_unlock(&vfile->lock);
+        return ret;
+    case VINPUT_IOCTL_REPLAY_START:
+        if (copy_from_user(&replay, (void __user *) arg, sizeof(replay)))
+            return -EFAULT;
+        return vinput_replay_start(vfile, &replay);
+    case VINPUT_IOCTL_REPLAY_STOP:
+        mutex_lock(&vfile->lock);
+        ret = vfile->replay ? 0 : -ENXIO;
+        if (vfile->replay)
+            vinput_player_stop(&vfile->replay->player);
+        mutex_unlock(&vfile->lock);
+        return ret;
+    case VINPUT_IOCTL_REPLAY_STATUS:
+        ret = vinput_replay_status(vfile, &status);
+        if (!ret && copy_to_user((void __user *) arg, &status, sizeof(status)))
+            ret = -EFAULT;
+        return ret;
+    }
+
+    return -ENOTTY;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/*
+ * io_uring passthrough: IORING_OP_URING_CMD submissions inject binary
+ * records or read capture records back, from and to the buffer described
+ * by struct vinput_uring_cmd in the SQE, a registered buffer when the SQE
+ * is flagged IORING_URING_CMD_FIXED. They complete inline; a submission
+ * that would wait for the file lock is retried by io_uring from a worker.
+ */
+static int vinput_uring_import(struct io_uring_cmd *ioucmd,
+                               unsigned int issue_flags,
+                               int rw,
+                               struct iovec *iov,
+                               struct iov_iter *iter)
+{
+    const struct vinput_uring_cmd *cmd = ioucmd->cmd;
+    u64 addr = READ_ONCE(cmd->addr);
+    u32 len = READ_ONCE(cmd->len);
+
+    if (READ_ONCE(cmd->pad))
+        return -EINVAL;
+    /* registered buffers, whose import gained issue_flags in 6.15 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    if (ioucmd->flags & IORING_URING_CMD_FIXED)
+        return io_uring_cmd_import_fixed(addr, len, rw, iter, ioucmd,
+                                         issue_flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    if (ioucmd->flags & IORING_URING_CMD_FIXED)
+        return io_uring_cmd_import_fixed(addr, len, rw, iter, ioucmd);
+#endif
+
+    /* import_single_range() is gone since 6.8, import_ubuf() is in 6.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    return import_ubuf(rw, u64_to_user_ptr(addr), len, iter);
+#else
+    return import_single_range(rw, u64_to_user_ptr(addr), len, iov, iter);
+#endif
+}
+
+/* Stage the binary records of from, under vfile->lock */
+static ssize_t vinput_uring_inject(struct vinput_file *vfile,
+                                   struct iov_iter *from)
+{
+    int i, n;
+    int err = 0;
+    size_t done = 0;
+    size_t count = iov_iter_count(from);
+    struct input_event *events = vfile->events;
+
+    if (vfile->ring)
+        return -EBUSY;
+    if (vfile->mode != VINPUT_MODE_BINARY ||
+        count % sizeof(struct input_event))
+        return -EINVAL;
+
+    while (done < count) {
+        n = min_t(size_t, (count - done) / sizeof(struct input_event),
+                  VINPUT_BATCH);
+
+        if (!copy_from_iter_full(events, n * sizeof(struct input_event),
+                                 from)) {
+            err = -EFAULT;
+            break;
+        }
+
+        i = vinput_stage_events(vfile, events, n, &err);
+        done += i * sizeof(struct input_event);
+        if (err)
+            break;
+    }
+
+    return done ? done : err;
+}
+
+/*
+ * Copy the pending capture records to to as struct input_event, without
+ * waiting for any, under vfile->lock.
+ */
+static ssize_t vinput_uring_capture(struct vinput_file *vfile,
+                                    struct iov_iter *to)
+{
+    int i, n;
+    int err = -EAGAIN;
+    size_t done = 0;
+    struct input_event ev;
+    struct vinput_record *recs;
+
+    if (!READ_ONCE(vfile->vinput->capture_size))
+        return -ENXIO;
+    if (iov_iter_count(to) < sizeof(ev))
+        return -EINVAL;
+
+    recs = kmalloc_array(VINPUT_CAPTURE_BATCH, sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+
+    while (iov_iter_count(to) >= sizeof(ev)) {
+        n = min_t(size_t, iov_iter_count(to) / sizeof(ev),
+                  VINPUT_CAPTURE_BATCH);
+        n = vinput_capture_take(vfile, recs, n);
+        if (!n)
+            break;
+
+        for (i = 0; i < n; i++) {
+            vinput_record_event(&ev, &recs[i]);
+            if (copy_to_iter(&ev, sizeof(ev), to) != sizeof(ev)) {
+                err = -EFAULT;
+                break;
+            }
+            done += sizeof(ev);
+        }
+        if (i < n)
+            break;
+    }
+
+    kfree(recs);
+
+    return done ? done : err;
+}
+
+static int vinput_uring_cmd(struct io_uring_cmd *ioucmd,
+                            unsigned int issue_flags)
+{
+    int idx;
+    ssize_t ret;
+    struct iovec iov;
+    struct iov_iter iter;
+    struct vinput_file *vfile = ioucmd->file->private_data;
+    struct vinput *vinput = vfile->vinput;
+    bool inject = ioucmd->cmd_op == VINPUT_URING_CMD_INJECT;
+
+    if (!inject && ioucmd->cmd_op != VINPUT_URING_CMD_CAPTURE)
+        return -ENOTTY;
+    /* refuse the records of a 32 bit ring, IO_URING_F_COMPAT is from 6.7 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    if (issue_flags & IO_URING_F_COMPAT)
+        return -EINVAL;
+#else
+    if (vinput_compat_events())
+        return -EINVAL;
+#endif
+
+    ret = vinput_uring_import(ioucmd, issue_flags, inject ? WRITE : READ,
+                              &iov, &iter);
+    if (ret)
+        return ret;
+
+    if (!(issue_flags & IO_URING_F_NONBLOCK))
+        mutex_lock(&vfile->lock);
+    else if (!mutex_trylock(&vfile->lock))
+        return -EAGAIN;
+
+    if (!inject) {
+        ret = vinput_uring_capture(vfile, &iter);
+    } else if (vinput_enter(vinput, &idx)) {
+        ret = vinput_uring_inject(vfile, &iter);
+        vinput_account_write(vinput, ret);
+        vinput_leave(idx);
+    } else {
+        ret = -ENODEV;
+    }
+    mutex_unlock(&vfile->lock);
+
+    return ret;
+}
+#endif
+
+static const struct file_operations vinput_fops = {
+    .owner = THIS_MODULE,
+    .open = vinput_open,
+    .release = vinput_release,
+    .read = vinput_read,
+    .poll = vinput_poll,
+    .write = vinput_write,
+    .unlocked_ioctl = vinput_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = vinput_mmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = vinput_uring_cmd,
+#endif
+};
+
+static int vinput_stats_show(struct seq_file *s, void *data)
+{
+    int cpu;
+    struct vinput *vinput = s->private;
+    struct vinput_stats *stats, sum = {};
+
+    for_each_possible_cpu (cpu) {
+        stats = per_cpu_ptr(vinput->stats, cpu);
+        sum.writes += stats->writes;
+        sum.events += stats->events;
+        sum.frames += stats->frames;
+        sum.bytes += stats->bytes;
+        sum.parse_errors += stats->parse_errors;
+        sum.rejected += stats->rejected;
+        sum.dropped += stats->dropped;
+    }
+
+    seq_printf(s, "writes: %llu\n", sum.writes);
+    seq_printf(s, "events: %llu\n", sum.events);
+    seq_printf(s, "frames: %llu\n", sum.frames);
+    seq_printf(s, "bytes: %llu\n", sum.bytes);
+    seq_printf(s, "parse_errors: %llu\n", sum.parse_errors);
+    seq_printf(s, "rejected: %llu\n", sum.rejected);
+    seq_printf(s, "dropped: %llu\n", sum.dropped);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vinput_stats);
+
+/* Report the upper bound of the bucket holding the given permille */
+static u64 vinput_percentile(const u64 *hist, u64 total, unsigned int permille)
+{
+    int i;
+    u64 count = 0;
+    u64 rank = div_u64(total * permille + 999, 1000);
+
+    for (i = 0; i < VINPUT_LAT_BUCKETS - 1; i++) {
+        count += hist[i];
+        if (count >= rank)
+            break;
+    }
+
+    return 1ULL << i;
+}
+
+/* Show the histogram at offset in struct vinput_stats with percentiles */
+static int vinput_hist_show(struct seq_file *s, size_t offset)
+{
+    int i, cpu;
+    u64 total = 0;
+    u64 hist[VINPUT_LAT_BUCKETS] = {};
+    struct vinput *vinput = s->private;
+    void *stats;
+
+    for_each_possible_cpu (cpu) {
+        stats = per_cpu_ptr(vinput->stats, cpu);
+        for (i = 0; i < VINPUT_LAT_BUCKETS; i++)
+            hist[i] += ((u64 *) (stats + offset))[i];
+    }
+    for (i = 0; i < VINPUT_LAT_BUCKETS; i++)
+        total += hist[i];
+
+    seq_printf(s, "frames: %llu\n", total);
+    if (!total)
+        return 0;
+
+    seq_printf(s, "p50: <%llu ns\n", vinput_percentile(hist, total, 500));
+    seq_printf(s, "p90: <%llu ns\n", vinput_percentile(hist, total, 900));
+    seq_printf(s, "p99: <%llu ns\n", vinput_percentile(hist, total, 990));
+    seq_printf(s, "p999: <%llu ns\n", vinput_percentile(hist, total, 999));
+
+    for (i = 0; i < VINPUT_LAT_BUCKETS; i++)
+        if (hist[i])
+            seq_printf(s, "%llu-%llu ns: %llu\n", i ? 1ULL << (i - 1) : 0,
+                       (1ULL << i) - 1, hist[i]);
+
+    return 0;
+}
+
+static int vinput_latency_show(struct seq_file *s, void *data)
+{
+    return vinput_hist_show(s, offsetof(struct vinput_stats, latency));
+}
+DEFINE_SHOW_ATTRIBUTE(vinput_latency);
+
+static int vinput_delivery_show(struct seq_file *s, void *data)
+{
+    return vinput_hist_show(s, offsetof(struct vinput_stats, delivery));
+}
+DEFINE_SHOW_ATTRIBUTE(vinput_delivery);
+
+static int vinput_lateness_show(struct seq_file *s, void *data)
+{
+    return vinput_hist_show(s, offsetof(struct vinput_stats, lateness));
+}
+DEFINE_SHOW_ATTRIBUTE(vinput_lateness);
+
+static ssize_t vinput_reset_write(struct file *file,
+                                  const char __user *buffer,
+                                  size_t count,
+                                  loff_t *offset)
+{
+    int cpu;
+    struct vinput *vinput = file->private_data;
+
+    for_each_possible_cpu (cpu)
+        memset(per_cpu_ptr(vinput->stats, cpu), 0, sizeof(struct vinput_stats));
+
+    return count;
+}
+
+static const struct file_operations vinput_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = vinput_reset_write,
+};
+
+/* /sys/kernel/debug/vinput/vinputN/{stats,latency,delivery,lateness,reset} */
+static void vinput_debugfs_add(struct vinput *vinput)
+{
+    vinput->debugfs = debugfs_create_dir(dev_name(&vinput->dev), vinput_debugfs);
+    debugfs_create_file("stats", 0444, vinput->debugfs, vinput,
+                        &vinput_stats_fops);
+    debugfs_create_file("latency", 0444, vinput->debugfs, vinput,
+                        &vinput_latency_fops);
+    if (latency_probe)
+        debugfs_create_file("delivery", 0444, vinput->debugfs, vinput,
+                            &vinput_delivery_fops);
+    debugfs_create_file("lateness", 0444, vinput->debugfs, vinput,
+                        &vinput_lateness_fops);
+    debugfs_create_file("reset", 0200, vinput->debugfs, vinput,
+                        &vinput_reset_fops);
+}
+
+/*
+ * Latency probe: an input handler bound only to the input devices created
+ * by vinput. It sees every frame when the input core delivers it to the
+ * handlers, synchronously from the emission of the frame, and records the
+ * time elapsed since the frame was queued. Frames the input core makes up
+ * itself, such as autorepeat, have no inject time and are not counted.
+ */
+static void vinput_probe_event(struct input_handle *handle,
+                               unsigned int type,
+                               unsigned int code,
+                               int value)
+{
+    int bucket;
+    u64 now, inject;
+    struct vinput *vinput = dev_to_vinput(handle->dev->dev.parent);
+
+    if (type != EV_SYN || code != SYN_REPORT)
+        return;
+
+    now = ktime_get_ns();
+    inject = READ_ONCE(vinput->inject_ns);
+    if (!inject || inject > now)
+        return;
+
+    bucket = min(fls64(now - inject), VINPUT_LAT_BUCKETS - 1);
+    this_cpu_inc(vinput->stats->delivery[bucket]);
+}
+
+static bool vinput_probe_match(struct input_handler *handler,
+                               struct input_dev *dev)
+{
+    return dev->dev.parent && dev->dev.parent->class == &vinput_class;
+}
+
+static int vinput_probe_connect(struct input_handler *handler,
+                                struct input_dev *dev,
+                                const struct input_device_id *id)
+{
+    int err;
+    struct input_handle *handle;
+
+    handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+    if (!handle)
+        return -ENOMEM;
+
+    handle->dev = dev;
+    handle->handler = handler;
+    handle->name = "vinput-probe";
+
+    err = input_register_handle(handle);
+    if (err)
+        goto fail_register;
+
+    err = input_open_device(handle);
+    if (err)
+        goto fail_open;
+
+    return 0;
+
+fail_open:
+    input_unregister_handle(handle);
+fail_register:
+    kfree(handle);
+    return err;
+}
+
+static void vinput_probe_disconnect(struct input_handle *handle)
+{
+    input_close_device(handle);
+    input_unregister_handle(handle);
+    kfree(handle);
+}
+
+static const struct input_device_id vinput_probe_ids[] = {
+    {.driver_info = 1}, /* every device, filtered by vinput_probe_match */
+    {},
+};
+
+static struct input_handler vinput_probe_handler = {
+    .name = "vinput-probe",
+    .event = vinput_probe_event,
+    .match = vinput_probe_match,
+    .connect = vinput_probe_connect,
+    .disconnect = vinput_probe_disconnect,
+    .id_table = vinput_probe_ids,
+};
+
+static void vinput_unregister_vdevice(struct vinput *vinput)
+{
+    struct vinput_frame *frame, *next;
+
+    debugfs_remove_recursive(vinput->debugfs);
+    vinput->debugfs = NULL;
+
+    /* wait for the writers still holding the device */
+    WRITE_ONCE(vinput->dead, true);
+    atomic_inc(&vinput_deaths);
+    synchronize_srcu(&vinput_srcu);
+    wake_up_interruptible_all(&vinput->capture_wait);
+
+    /* no trigger nor upload can touch the macros once the writers are gone */
+    vinput_player_stop(&vinput->macros->player);
+
+    /* writers flush their frames before leaving, this is only defensive */
+    llist_for_each_entry_safe (frame, next, llist_del_all(&vinput->frames),
+                               node)
+        kfree(frame);
+
+    if (device_is_registered(&vinput->input->dev))
+        input_unregister_device(vinput->input);
+    else
+        input_free_device(vinput->input);
+    if (vinput->type->ops->kill)
+        vinput->type->ops->kill(vinput);
+}
+
+/* Tear down a device whose xarray entry was erased by the caller */
+static void vinput_unexport_vdevice(struct vinput *vinput)
+{
+    vinput_unregister_vdevice(vinput);
+    cdev_device_del(&vinput->cdev, &vinput->dev);
+    put_device(&vinput->dev);
+}
+
+static void vinput_destroy_vdevice(struct vinput *vinput)
+{
+    ida_free(&vinput_ids, vinput->id);
+    free_percpu(vinput->stats);
+    kvfree(vinput->capture);
+    vinput_macros_free(vinput->macros);
+
+    module_put(THIS_MODULE);
+
+    /* lookups may still be reading it under RCU */
+    kfree_rcu(vinput, rcu);
+}
+
+static void vinput_release_dev(struct device *dev)
+{
+    struct vinput *vinput = dev_to_vinput(dev);
+    int id = vinput->id;
+
+    vinput_destroy_vdevice(vinput);
+
+    pr_debug("released vinput%d.\n", id);
+}
+
+static struct vinput *vinput_alloc_vdevice(void)
+{
+    int err;
+    struct vinput *vinput = kzalloc(sizeof(struct vinput), GFP_KERNEL);
+
+    if (!vinput)
+        return ERR_PTR(-ENOMEM);
+
+    try_module_get(THIS_MODULE);
+
+    spin_lock_init(&vinput->lock);
+    init_llist_head(&vinput->frames);
+    spin_lock_init(&vinput->capture_lock);
+    init_waitqueue_head(&vinput->capture_wait);
+    init_waitqueue_head(&vinput->busy_wait);
+
+    vinput->id = ida_alloc_max(&vinput_ids, max_devices - 1, GFP_KERNEL);
+    if (vinput->id < 0) {
+        err = vinput->id == -ENOSPC ? -ENOBUFS : vinput->id;
+        goto fail_id;
+    }
+
+    vinput->stats = alloc_percpu(struct vinput_stats);
+    if (!vinput->stats) {
+        err = -ENOMEM;
+        goto fail_stats;
+    }
+
+    err = vinput_capture_resize(vinput, capture_size);
+    if (err)
+        goto fail_capture;
+
+    vinput->macros = vinput_macros_alloc(vinput);
+    if (!vinput->macros) {
+        err = -ENOMEM;
+        goto fail_macros;
+    }
+
+    /* allocate the input device */
+    vinput->input = input_allocate_device();
+    if (vinput->input == NULL) {
+        pr_err("vinput: Cannot allocate vinput input device\n");
+        err = -ENOMEM;
+        goto fail_input_dev;
+    }
+
+    /* initialize device, from now on it is released by put_device() */
+    device_initialize(&vinput->dev);
+    vinput->dev.class = &vinput_class;
+    vinput->dev.release = vinput_release_dev;
+    vinput->dev.devt = MKDEV(MAJOR(vinput_devt), vinput->id);
+    dev_set_name(&vinput->dev, DRIVER_NAME "%lu", vinput->id);
+
+    cdev_init(&vinput->cdev, &vinput_fops);
+    vinput->cdev.owner = THIS_MODULE;
+
+    return vinput;
+
+fail_input_dev:
+    vinput_macros_free(vinput->macros);
+fail_macros:
+    kvfree(vinput->capture);
+fail_capture:
+    free_percpu(vinput->stats);
+fail_stats:
+    ida_free(&vinput_ids, vinput->id);
+fail_id:
+    module_put(THIS_MODULE);
+    kfree(vinput);
+
+    return ERR_PTR(err);
+}
+
+static int vinput_register_vdevice(struct vinput *vinput)
+{
+    int err = 0;
+
+    const struct vinput_config *config = vinput->config;
+
+    /* register the input device */
+    strscpy(vinput->name, config && config->name[0] ? config->name :
+                                                      vinput->type->name,
+            sizeof(vinput->name));
+    vinput->input->name = vinput->name;
+    vinput->input->phys = "vinput";
+    vinput->input->dev.parent = &vinput->dev;
+
+    vinput->input->id.bustype = BUS_VIRTUAL;
+    vinput->input->id.product = 0x0000;
+    vinput->input->id.vendor = 0x0000;
+    vinput->input->id.version = 0x0000;
+    if (config) {
+        if (config->vendor >= 0)
+            vinput->input->id.vendor = config->vendor;
+        if (config->product >= 0)
+            vinput->input->id.product = config->product;
+        if (config->version >= 0)
+            vinput->input->id.version = config->version;
+    }
+
+    err = vinput->type->ops->init(vinput);
+
+    if (err == 0)
+        dev_info(&vinput->dev, "Registered virtual input %s %ld\n",
+                 vinput->type->name, vinput->id);
+
+    return err;
+}
+
+/*
+ * Create, register and publish a device, returns its id. config, when not
+ * NULL, is handed to the init op of the driver.
+ */
+static long vinput_export(struct vinput_device *device,
+                          const struct vinput_config *config,
+                          bool owned)
+{
+    int err;
+    struct vinput *vinput;
+
+    vinput = vinput_alloc_vdevice();
+    if (IS_ERR(vinput))
+        return PTR_ERR(vinput);
+
+    vinput->type = device;
+    vinput->owned = owned;
+    err = cdev_device_add(&vinput->cdev, &vinput->dev);
+    if (err < 0)
+        goto fail_register;
+
+    vinput->config = config;
+    err = vinput_register_vdevice(vinput);
+    vinput->config = NULL;
+    if (err < 0)
+        goto fail_register_vinput;
+
+    vinput_debugfs_add(vinput);
+
+    /* publish it to open() and unexport, or to its owner only */
+    err = xa_insert(vinput_xa(vinput), vinput->id, vinput, GFP_KERNEL);
+    if (err < 0)
+        goto fail_register_vinput;
+
+    return vinput->id;
+
+fail_register_vinput:
+    vinput_unexport_vdevice(vinput);
+    return err;
+fail_register:
+    input_free_device(vinput->input);
+    put_device(&vinput->dev);
+    return err;
+}
+
+/*
+ * Bulk export and unexport requests are run in parallel on an unbound
+ * workqueue. Their progress is reported by the pending and failed class
+ * attributes, failed counting the devices the bulk requests failed to
+ * export or unexport since the last one was made.
+ */
+struct vinput_work {
+    struct work_struct work;
+    struct list_head list;
+    struct vinput_device *type;
+    struct vinput *vinput;
+};
+
+static struct workqueue_struct *vinput_wq;
+static atomic_t vinput_pending = ATOMIC_INIT(0);
+static atomic_t vinput_failed = ATOMIC_INIT(0);
+
+static void vinput_work_fn(struct work_struct *work)
+{
+    struct vinput_work *vwork = container_of(work, struct vinput_work, work);
+
+    if (vwork->vinput)
+        vinput_unexport_vdevice(vwork->vinput);
+    else if (vinput_export(vwork->type, NULL, false) < 0)
+        atomic_inc(&vinput_failed);
+
+    atomic_dec(&vinput_pending);
+    kfree(vwork);
+}
+
+static struct vinput_work *vinput_work_alloc(void)
+{
+    struct vinput_work *vwork = kzalloc(sizeof(struct vinput_work), GFP_KERNEL);
+
+    if (vwork)
+        INIT_WORK(&vwork->work, vinput_work_fn);
+
+    return vwork;
+}
+
+/*
+ * Queue count exports of a device type. The type is checked again under
+ * vinput_lock, which vinput_unregister() takes before flushing the
+ * workqueue, so no export can be queued for a type going away.
+ */
+static int vinput_export_async(struct vinput_device *device, unsigned int count)
+{
+    int err = 0;
+    unsigned int i;
+    struct vinput_device *curr;
+    struct vinput_work *vwork, *next;
+    LIST_HEAD(works);
+
+    atomic_set(&vinput_failed, 0);
+    for (i = 0; i < count; i++) {
+        vwork = vinput_work_alloc();
+        if (!vwork) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        vwork->type = device;
+        list_add(&vwork->list, &works);
+    }
+
+    spin_lock(&vinput_lock);
+    list_for_each_entry (curr, &vinput_devices, list)
+        if (curr == device)
+            break;
+    if (curr != device) {
+        spin_unlock(&vinput_lock);
+        err = -ENODEV;
+        goto fail;
+    }
+    atomic_add(count, &vinput_pending);
+    list_for_each_entry_safe (vwork, next, &works, list)
+        queue_work(vinput_wq, &vwork->work);
+    spin_unlock(&vinput_lock);
+
+    return 0;
+
+fail:
+    list_for_each_entry_safe (vwork, next, &works, list)
+        kfree(vwork);
+    return err;
+}
+
+/*
+ * Claim every exported device with an id in [first, last] and queue it,
+ * returns the number of devices queued. Devices left over by a failed
+ * allocation stay exported and are counted as failed.
+ */
+static int vinput_unexport_async(unsigned long first, unsigned long last)
+{
+    unsigned long id, left;
+    int count = 0;
+    int failed = 0;
+    struct vinput *vinput;
+    struct vinput_work *vwork;
+
+    atomic_set(&vinput_failed, 0);
+    xa_for_each_range (&vinput_vdevices, id, vinput, first, last) {
+        vwork = vinput_work_alloc();
+        if (!vwork) {
+            xa_for_each_range (&vinput_vdevices, left, vinput, id, last)
+                failed++;
+            atomic_add(failed, &vinput_failed);
+            break;
+        }
+
+        vwork->vinput = xa_erase(&vinput_vdevices, id);
+        if (!vwork->vinput) {
+            kfree(vwork);
+            continue;
+        }
+
+        atomic_inc(&vinput_pending);
+        queue_work(vinput_wq, &vwork->work);
+        count++;
+    }
+
+    if (count)
+        return count;
+    return failed ? -ENOMEM : -ENODEV;
+}
+
+static ssize_t export_store(struct class *class,
+                            struct class_attribute *attr,
+                            const char *buf,
+                            size_t len)
+{
+    long err;
+    const char *arg;
+    unsigned int count;
+    struct vinput_device *device;
+
+    device = vinput_get_device_by_type(buf);
+    if (IS_ERR(device)) {
+        pr_info("vinput: This virtual device isn't registered\n");
+        return PTR_ERR(device);
+    }
+
+    /* "<type>" is exported synchronously, "<type> <count>" in bulk */
+    arg = skip_spaces(buf + strlen(device->name));
+    if (!*arg) {
+        err = vinput_export(device, NULL, false);
+        return err < 0 ? err : len;
+    }
+
+    if (kstrtouint(arg, 10, &count) || !count || count > max_devices)
+        return -EINVAL;
+
+    err = vinput_export_async(device, count);
+
+    return err < 0 ? err : len;
+}
+static CLASS_ATTR_WO(export);
+
+static ssize_t unexport_store(struct class *class,
+                              struct class_attribute *attr,
+                              const char *buf,
+                              size_t len)
+{
+    int err;
+    unsigned long id, last;
+    struct vinput *vinput;
+
+    /* "<first>-<last>" is unexported in bulk */
+    if (sscanf(buf, "%lu-%lu", &id, &last) == 2) {
+        if (id > last)
+            return -EINVAL;
+        err = vinput_unexport_async(id, last);
+        return err < 0 ? err : len;
+    }
+
+    err = kstrtoul(buf, 10, &id);
+    if (err) {
+        err = -EINVAL;
+        goto failed;
+    }
+
+    vinput = xa_erase(&vinput_vdevices, id);
+    if (!vinput) {
+        pr_err("vinput: No such vinput device %lu\n", id);
+        err = -ENODEV;
+        goto failed;
+    }
+
+    vinput_unexport_vdevice(vinput);
+
+    return len;
+failed:
+    return err;
+}
+static CLASS_ATTR_WO(unexport);
+
+static ssize_t pending_show(struct class *class,
+                            struct class_attribute *attr,
+                            char *buf)
+{
+    return sprintf(buf, "%d\n", atomic_read(&vinput_pending));
+}
+static CLASS_ATTR_RO(pending);
+
+static ssize_t failed_show(struct class *class,
+                           struct class_attribute *attr,
+                           char *buf)
+{
+    return sprintf(buf, "%d\n", atomic_read(&vinput_failed));
+}
+static CLASS_ATTR_RO(failed);
+
+static struct attribute *vinput_class_attrs[] = {
+    &class_attr_export.attr,
+    &class_attr_unexport.attr,
+    &class_attr_pending.attr,
+    &class_attr_failed.attr,
+    NULL,
+};
+
+ATTRIBUTE_GROUPS(vinput_class);
+
+static ssize_t capture_size_show(struct device *dev,
+                                 struct device_attribute *attr,
+                                 char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_vinput(dev)->capture_size));
+}
+
+/* Resize the capture ring of a device, discarding its records; 0 stops it */
+static ssize_t capture_size_store(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf,
+                                  size_t len)
+{
+    int err;
+    unsigned int size;
+
+    err = kstrtouint(buf, 0, &size);
+    if (err)
+        return err;
+
+    err = vinput_capture_resize(dev_to_vinput(dev), size);
+
+    return err ? err : len;
+}
+static DEVICE_ATTR_RW(capture_size);
+
+static ssize_t macros_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    int len = 0;
+    struct vinput_macro *macro;
+    struct vinput_macros *macros = dev_to_vinput(dev)->macros;
+
+    mutex_lock(&macros->lock);
+    list_for_each_entry (macro, &macros->list, list)
+        len += sysfs_emit_at(buf, len, "%s %u %u\n", macro->name,
+                             macro->steps, macro->count);
+    mutex_unlock(&macros->lock);
+
+    return len;
+}
+
+/*
+ * Each line is "<name> <records>" to define a macro, or "<name>" alone to
+ * delete it. Lines are applied in order up to the first failing one.
+ */
+static ssize_t macros_store(struct device *dev,
+                            struct device_attribute *attr,
+                            const char *buf,
+                            size_t len)
+{
+    int idx;
+    int err = 0;
+    char *copy, *pos, *line, *name;
+    struct vinput *vinput = dev_to_vinput(dev);
+
+    copy = kstrndup(buf, len, GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+
+    /* macros are checked against the input device, keep it alive */
+    if (!vinput_enter(vinput, &idx)) {
+        kfree(copy);
+        return -ENODEV;
+    }
+
+    pos = copy;
+    while (!err && (line = strsep(&pos, "\n"))) {
+        if (!*line)
+            continue;
+        name = strsep(&line, " ");
+        err = vinput_macro_set(vinput, name, line);
+    }
+    vinput_leave(idx);
+    kfree(copy);
+
+    return err ? err : len;
+}
+static DEVICE_ATTR_RW(macros);
+
+static struct attribute *vinput_dev_attrs[] = {
+    &dev_attr_capture_size.attr,
+    &dev_attr_macros.attr,
+    NULL,
+};
+
+ATTRIBUTE_GROUPS(vinput_dev);
+
+static struct class vinput_class = {
+    .name = "vinput",
+    .owner = THIS_MODULE,
+    .class_groups = vinput_class_groups,
+    .dev_groups = vinput_dev_groups,
+};
+
+int vinput_register(struct vinput_device *dev)
+{
+    spin_lock(&vinput_lock);
+    list_add(&dev->list, &vinput_devices);
+    spin_unlock(&vinput_lock);
+
+    pr_info("vinput: registered new virtual input device '%s'\n", dev->name);
+
+    return 0;
+}
+EXPORT_SYMBOL(vinput_register);
+
+void vinput_unregister(struct vinput_device *dev)
+{
+    struct xarray *xas[] = {&vinput_vdevices, &vinput_owned};
+    unsigned long id;
+    unsigned int i;
+    struct vinput *vinput, *next;
+    LIST_HEAD(doomed);
+
+    /* Remove from the list first */
+    spin_lock(&vinput_lock);
+    list_del(&dev->list);
+    spin_unlock(&vinput_lock);
+
+    /* let the bulk requests in flight settle */
+    flush_workqueue(vinput_wq);
+
+    /* unregister all devices of this type, owned ones included */
+    for (i = 0; i < ARRAY_SIZE(xas); i++) {
+        xa_lock(xas[i]);
+        xa_for_each (xas[i], id, vinput) {
+            if (vinput->type == dev) {
+                __xa_erase(xas[i], id);
+                list_add(&vinput->list, &doomed);
+            }
+        }
+        xa_unlock(xas[i]);
+    }
+
+    list_for_each_entry_safe (vinput, next, &doomed, list)
+        vinput_unexport_vdevice(vinput);
+
+    pr_info("vinput: unregistered virtual input device '%s'\n", dev->name);
+}
+EXPORT_SYMBOL(vinput_unregister);
+
+/* Export a device and return it with a reference held */
+static struct vinput *vinput_get_export(struct vinput_device *type,
+                                        const struct vinput_config *config,
+                                        bool owned)
+{
+    long id = vinput_export(type, config, owned);
+
+    if (id < 0)
+        return ERR_PTR(id);
+    return vinput_get_vdevice(owned ? &vinput_owned : &vinput_vdevices, id);
+}
+
+/*
+ * Unexport a device returned by vinput_get_export(), unless it already
+ * was, by unexport or by the unregistration of its driver, and put it.
+ */
+static void vinput_put_export(struct vinput *vinput)
+{
+    if (xa_cmpxchg(vinput_xa(vinput), vinput->id, vinput, NULL, 0) == vinput)
+        vinput_unexport_vdevice(vinput);
+    put_device(&vinput->dev);
+}
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+/* Export a device for the KUnit tests, returned with a reference held */
+struct vinput *vinput_test_create(struct vinput_device *type)
+{
+    return vinput_get_export(type, NULL, false);
+}
+EXPORT_SYMBOL_GPL(vinput_test_create);
+
+struct vinput *vinput_test_create_config(struct vinput_device *type,
+                                         const struct vinput_config *config)
+{
+    return vinput_get_export(type, config, false);
+}
+EXPORT_SYMBOL_GPL(vinput_test_create_config);
+
+void vinput_test_destroy(struct vinput *vinput)
+{
+    vinput_put_export(vinput);
+}
+EXPORT_SYMBOL_GPL(vinput_test_destroy);
+#endif
+
+#if IS_REACHABLE(CONFIG_CONFIGFS_FS)
+/*
+ * configfs: each directory made in /sys/kernel/config/vinput describes a
+ * device, which is created and registered at once when 1 is written to its
+ * enable attribute, and unexported when 0 is or when the directory is
+ * removed. Attributes cannot change while the device is enabled.
+ */
+struct vinput_cfg {
+    struct config_item item;
+    struct mutex lock;
+    char type[sizeof_field(struct vinput_device, name)];
+    struct vinput_config config;
+    /* enabled device, with a reference held */
+    struct vinput *vinput;
+};
+
+static struct vinput_cfg *to_vinput_cfg(struct config_item *item)
+{
+    return container_of(item, struct vinput_cfg, item);
+}
+
+/* Copy a line to a string attribute of a disabled device */
+static ssize_t vinput_cfg_store_str(struct config_item *item,
+                                    char *str,
+                                    size_t size,
+                                    const char *page,
+                                    size_t len)
+{
+    int err = 0;
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    if (strcspn(page, "\n") >= size)
+        return -EINVAL;
+
+    mutex_lock(&cfg->lock);
+    if (cfg->vinput) {
+        err = -EBUSY;
+    } else {
+        memset(str, 0, size);
+        memcpy(str, page, strcspn(page, "\n"));
+    }
+    mutex_unlock(&cfg->lock);
+
+    return err ? err : len;
+}
+
+static ssize_t vinput_cfg_store_int(struct config_item *item,
+                                    int *val,
+                                    int max,
+                                    const char *page,
+                                    size_t len)
+{
+    int err;
+    int v;
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    err = kstrtoint(page, 0, &v);
+    if (err)
+        return err;
+    if (v < -1 || v > max)
+        return -ERANGE;
+
+    mutex_lock(&cfg->lock);
+    if (cfg->vinput)
+        err = -EBUSY;
+    else
+        *val = v;
+    mutex_unlock(&cfg->lock);
+
+    return err ? err : len;
+}
+
+#define VINPUT_CFG_INT_ATTR(field, max)                                        \
+    static ssize_t vinput_cfg_##field##_show(struct config_item *item,         \
+                                             char *page)                       \
+    {                                                                          \
+        return sprintf(page, "%d\n", to_vinput_cfg(item)->config.field);       \
+    }                                                                          \
+    static ssize_t vinput_cfg_##field##_store(struct config_item *item,        \
+                                              const char *page, size_t len)    \
+    {                                                                          \
+        return vinput_cfg_store_int(item, &to_vinput_cfg(item)->config.field,  \
+                                    max, page, len);                           \
+    }                                                                          \
+    CONFIGFS_ATTR(vinput_cfg_, field)
+
+VINPUT_CFG_INT_ATTR(vendor, U16_MAX);
+VINPUT_CFG_INT_ATTR(product, U16_MAX);
+VINPUT_CFG_INT_ATTR(version, U16_MAX);
+VINPUT_CFG_INT_ATTR(max_x, INT_MAX);
+VINPUT_CFG_INT_ATTR(max_y, INT_MAX);
+VINPUT_CFG_INT_ATTR(max_z, INT_MAX);
+/* vts sizes its slot tables from it, refuse more than it can track */
+VINPUT_CFG_INT_ATTR(max_points, VINPUT_MAX_POINTS);
+
+static ssize_t vinput_cfg_type_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_vinput_cfg(item)->type);
+}
+
+static ssize_t vinput_cfg_type_store(struct config_item *item,
+                                     const char *page,
+                                     size_t len)
+{
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    return vinput_cfg_store_str(item, cfg->type, sizeof(cfg->type), page,
+                                len);
+}
+CONFIGFS_ATTR(vinput_cfg_, type);
+
+static ssize_t vinput_cfg_name_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", to_vinput_cfg(item)->config.name);
+}
+
+static ssize_t vinput_cfg_name_store(struct config_item *item,
+                                     const char *page,
+                                     size_t len)
+{
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    return vinput_cfg_store_str(item, cfg->config.name,
+                                sizeof(cfg->config.name), page, len);
+}
+CONFIGFS_ATTR(vinput_cfg_, name);
+
+static ssize_t vinput_cfg_mt_type_show(struct config_item *item, char *page)
+{
+    char type = to_vinput_cfg(item)->config.mt_type;
+
+    return type ? sprintf(page, "%c\n", type) : sprintf(page, "\n");
+}
+
+static ssize_t vinput_cfg_mt_type_store(struct config_item *item,
+                                        const char *page,
+                                        size_t len)
+{
+    int err = 0;
+    char type = toupper(page[0]);
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    if (type != 'A' && type != 'B')
+        return -EPROTONOSUPPORT;
+
+    mutex_lock(&cfg->lock);
+    if (cfg->vinput)
+        err = -EBUSY;
+    else
+        cfg->config.mt_type = type;
+    mutex_unlock(&cfg->lock);
+
+    return err ? err : len;
+}
+CONFIGFS_ATTR(vinput_cfg_, mt_type);
+
+/* keys is a list of keycodes and ranges, as "1-88,272-274" */
+static ssize_t vinput_cfg_keys_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%*pbl\n", KEY_CNT, to_vinput_cfg(item)->config.keys);
+}
+
+static ssize_t vinput_cfg_keys_store(struct config_item *item,
+                                     const char *page,
+                                     size_t len)
+{
+    int err;
+    unsigned long *keys;
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    keys = bitmap_zalloc(KEY_CNT, GFP_KERNEL);
+    if (!keys)
+        return -ENOMEM;
+
+    err = bitmap_parselist(page, keys, KEY_CNT);
+    if (!err) {
+        mutex_lock(&cfg->lock);
+        if (cfg->vinput)
+            err = -EBUSY;
+        else
+            bitmap_copy(cfg->config.keys, keys, KEY_CNT);
+        mutex_unlock(&cfg->lock);
+    }
+    bitmap_free(keys);
+
+    return err ? err : len;
+}
+CONFIGFS_ATTR(vinput_cfg_, keys);
+
+/* id of the enabled device, -1 otherwise */
+static ssize_t vinput_cfg_id_show(struct config_item *item, char *page)
+{
+    long id = -1;
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    mutex_lock(&cfg->lock);
+    if (cfg->vinput)
+        id = cfg->vinput->id;
+    mutex_unlock(&cfg->lock);
+
+    return sprintf(page, "%ld\n", id);
+}
+CONFIGFS_ATTR_RO(vinput_cfg_, id);
+
+static void vinput_cfg_disable(struct vinput_cfg *cfg)
+{
+    if (!cfg->vinput)
+        return;
+
+    vinput_put_export(cfg->vinput);
+    cfg->vinput = NULL;
+}
+
+static ssize_t vinput_cfg_enable_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%d\n", !!READ_ONCE(to_vinput_cfg(item)->vinput));
+}
+
+static ssize_t vinput_cfg_enable_store(struct config_item *item,
+                                       const char *page,
+                                       size_t len)
+{
+    int err;
+    bool enable;
+    struct vinput *vinput;
+    struct vinput_device *device;
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    err = kstrtobool(page, &enable);
+    if (err)
+        return err;
+
+    mutex_lock(&cfg->lock);
+    if (!enable) {
+        vinput_cfg_disable(cfg);
+    } else if (!cfg->vinput) {
+        device = cfg->type[0] ? vinput_get_device_by_type(cfg->type) :
+                                ERR_PTR(-ENODEV);
+        vinput = IS_ERR(device)
+                     ? ERR_CAST(device)
+                     : vinput_get_export(device, &cfg->config, false);
+        if (IS_ERR(vinput))
+            err = PTR_ERR(vinput);
+        else
+            WRITE_ONCE(cfg->vinput, vinput);
+    }
+    mutex_unlock(&cfg->lock);
+
+    return err ? err : len;
+}
+CONFIGFS_ATTR(vinput_cfg_, enable);
+
+static struct configfs_attribute *vinput_cfg_attrs[] = {
+    &vinput_cfg_attr_type,
+    &vinput_cfg_attr_name,
+    &vinput_cfg_attr_vendor,
+    &vinput_cfg_attr_product,
+    &vinput_cfg_attr_version,
+    &vinput_cfg_attr_mt_type,
+    &vinput_cfg_attr_max_x,
+    &vinput_cfg_attr_max_y,
+    &vinput_cfg_attr_max_z,
+    &vinput_cfg_attr_max_points,
+    &vinput_cfg_attr_keys,
+    &vinput_cfg_attr_id,
+    &vinput_cfg_attr_enable,
+    NULL,
+};
+
+static void vinput_cfg_release(struct config_item *item)
+{
+    struct vinput_cfg *cfg = to_vinput_cfg(item);
+
+    vinput_cfg_disable(cfg);
+    kfree(cfg);
+}
+
+static struct configfs_item_operations vinput_cfg_item_ops = {
+    .release = vinput_cfg_release,
+};
+
+static const struct config_item_type vinput_cfg_item_type = {
+    .ct_item_ops = &vinput_cfg_item_ops,
+    .ct_attrs = vinput_cfg_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct config_item *vinput_cfg_make_item(struct config_group *group,
+                                                const char *name)
+{
+    struct vinput_cfg *cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+
+    if (!cfg)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_init(&cfg->lock);
+    cfg->config.vendor = -1;
+    cfg->config.product = -1;
+    cfg->config.version = -1;
+    cfg->config.max_x = -1;
+    cfg->config.max_y = -1;
+    cfg->config.max_z = -1;
+    cfg->config.max_points = -1;
+    config_item_init_type_name(&cfg->item, name, &vinput_cfg_item_type);
+
+    return &cfg->item;
+}
+
+static struct configfs_group_operations vinput_cfg_group_ops = {
+    .make_item = vinput_cfg_make_item,
+};
+
+static const struct config_item_type vinput_cfg_type = {
+    .ct_group_ops = &vinput_cfg_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem vinput_cfg_subsys = {
+    .su_group = {
+        .cg_item = {
+            .ci_namebuf = DRIVER_NAME,
+            .ci_type = &vinput_cfg_type,
+        },
+    },
+};
+
+static int vinput_configfs_init(void)
+{
+    config_group_init(&vinput_cfg_subsys.su_group);
+    mutex_init(&vinput_cfg_subsys.su_mutex);
+
+    return configfs_register_subsystem(&vinput_cfg_subsys);
+}
+
+static void vinput_configfs_exit(void)
+{
+    configfs_unregister_subsystem(&vinput_cfg_subsys);
+}
+#else
+static int vinput_configfs_init(void)
+{
+    return 0;
+}
+
+static void vinput_configfs_exit(void) {}
+#endif
+
+/*
+ * /dev/vinput-control: a file opened on it creates a device of its own
+ * with VINPUT_IOCTL_CREATE, then stands for the /dev/vinputX node of that
+ * device until it is closed, which unexports the device.
+ */
+static int vinput_control_open(struct inode *inode, struct file *file)
+{
+    file->private_data = NULL;
+    return 0;
+}
+
+static int vinput_control_release(struct inode *inode, struct file *file)
+{
+    struct vinput_file *vfile = file->private_data;
+    struct vinput *vinput;
+
+    if (!vfile)
+        return 0;
+
+    vinput = vfile->vinput;
+    vinput_release(inode, file);
+    vinput_put_export(vinput);
+
+    return 0;
+}
+
+/* Create the device of a control file, return its id */
+static long vinput_control_create(struct file *file,
+                                  struct vinput_create *req)
+{
+    struct vinput_config config;
+    struct vinput_device *device;
+    struct vinput_file *vfile;
+    struct vinput *vinput;
+
+    if (req->pad ||
+        (req->mt_type && req->mt_type != 'A' && req->mt_type != 'B'))
+        return -EINVAL;
+    if (READ_ONCE(file->private_data))
+        return -EBUSY;
+
+    memset(&config, 0, sizeof(config));
+    strscpy(config.name, req->name, sizeof(config.name));
+    config.vendor = req->vendor;
+    config.product = req->product;
+    config.version = req->version;
+    config.mt_type = req->mt_type;
+    config.max_x = req->max_x;
+    config.max_y = req->max_y;
+    config.max_z = req->max_z;
+    config.max_points = req->max_points;
+
+    req->type[sizeof(req->type) - 1] = '\0';
+    device = req->type[0] ? vinput_get_device_by_type(req->type) :
+                            ERR_PTR(-ENODEV);
+    if (IS_ERR(device))
+        return PTR_ERR(device);
+
+    vinput = vinput_get_export(device, &config, true);
+    if (IS_ERR(vinput))
+        return PTR_ERR(vinput);
+
+    vfile = vinput_file_alloc(vinput);
+    if (IS_ERR(vfile)) {
+        vinput_put_export(vinput);
+        return PTR_ERR(vfile);
+    }
+
+    /* a concurrent create on the same file may have won */
+    if (cmpxchg(&file->private_data, NULL, vfile)) {
+        vinput_file_free(vfile);
+        vinput_put_export(vinput);
+        return -EBUSY;
+    }
+
+    return vinput->id;
+}
+
+static long vinput_control_ioctl(struct file *file,
+                                 unsigned int cmd,
+                                 unsigned long arg)
+{
+    long id;
+    struct vinput_create req;
+    struct vinput_create __user *ureq = (void __user *) arg;
+
+    if (cmd == VINPUT_IOCTL_CREATE) {
+        if (copy_from_user(&req, ureq, sizeof(req)))
+            return -EFAULT;
+        id = vinput_control_create(file, &req);
+        if (id < 0)
+            return id;
+        /* the device stays with the file, closing it cleans up */
+        return put_user((__s32) id, &ureq->id) ? -EFAULT : 0;
+    }
+    if (!READ_ONCE(file->private_data))
+        return -ENXIO;
+
+    return vinput_ioctl(file, cmd, arg);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static int vinput_control_uring_cmd(struct io_uring_cmd *ioucmd,
+                                    unsigned int issue_flags)
+{
+    long id;
+    struct vinput_create req;
+    const struct vinput_uring_cmd *cmd = ioucmd->cmd;
+    struct vinput_create __user *ureq;
+
+    if (ioucmd->cmd_op != VINPUT_URING_CMD_CREATE) {
+        if (!READ_ONCE(ioucmd->file->private_data))
+            return -ENXIO;
+        return vinput_uring_cmd(ioucmd, issue_flags);
+    }
+
+    /* exporting a device sleeps */
+    if (issue_flags & IO_URING_F_NONBLOCK)
+        return -EAGAIN;
+
+    ureq = u64_to_user_ptr(READ_ONCE(cmd->addr));
+    if (READ_ONCE(cmd->len) != sizeof(req) || READ_ONCE(cmd->pad))
+        return -EINVAL;
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    id = vinput_control_create(ioucmd->file, &req);
+    if (id < 0)
+        return id;
+
+    return put_user((__s32) id, &ureq->id) ? -EFAULT : id;
+}
+#endif
+
+static ssize_t vinput_control_read(struct file *file,
+                                   char __user *buffer,
+                                   size_t count,
+                                   loff_t *offset)
+{
+    if (!READ_ONCE(file->private_data))
+        return -ENXIO;
+
+    return vinput_read(file, buffer, count, offset);
+}
+
+static ssize_t vinput_control_write(struct file *file,
+                                    const char __user *buffer,
+                                    size_t count,
+                                    loff_t *offset)
+{
+    if (!READ_ONCE(file->private_data))
+        return -ENXIO;
+
+    return vinput_write(file, buffer, count, offset);
+}
+
+static __poll_t vinput_control_poll(struct file *file, poll_table *wait)
+{
+    if (!READ_ONCE(file->private_data))
+        return EPOLLERR;
+
+    return vinput_poll(file, wait);
+}
+
+static int vinput_control_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    if (!READ_ONCE(file->private_data))
+        return -ENXIO;
+
+    return vinput_mmap(file, vma);
+}
+
+static const struct file_operations vinput_control_fops = {
+    .owner = THIS_MODULE,
+    .open = vinput_control_open,
+    .release = vinput_control_release,
+    .read = vinput_control_read,
+    .poll = vinput_control_poll,
+    .write = vinput_control_write,
+    .unlocked_ioctl = vinput_control_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = vinput_control_mmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = vinput_control_uring_cmd,
+#endif
+};
+
+static struct miscdevice vinput_control = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "vinput-control",
+    .fops = &vinput_control_fops,
+};
+
+/*
+ * /dev/vinput-mux: each record written carries the id of the device it is
+ * routed to, and is staged into a frame of that device like a binary write
+ * to its node, through a state kept per device for the open file. A
+ * SYN_REPORT record ends the frame of its device, and the end of a write
+ * ends the frames still open, each with its own SYN_REPORT. As it reaches
+ * every device, the node is root only and its opener needs CAP_SYS_ADMIN.
+ */
+struct vinput_mux {
+    struct mutex lock;
+    /* vinput_file per device id, marked while a frame is open */
+    struct xarray files;
+    struct vinput_mux_event *events;
+    /* vinput_deaths when the cache was last swept */
+    int deaths;
+};
+
+#define VINPUT_MUX_OPEN XA_MARK_0
+/* devices written to by the current write, to account */
+#define VINPUT_MUX_ROUTED XA_MARK_2
+
+static struct vinput_mux *vinput_mux_alloc(void)
+{
+    struct vinput_mux *mux = kzalloc(sizeof(*mux), GFP_KERNEL);
+
+    if (!mux)
+        return NULL;
+
+    mux->events = kmalloc_array(VINPUT_BATCH, sizeof(*mux->events),
+                                GFP_KERNEL);
+    if (!mux->events) {
+        kfree(mux);
+        return NULL;
+    }
+    mutex_init(&mux->lock);
+    xa_init(&mux->files);
+    mux->deaths = atomic_read(&vinput_deaths);
+
+    return mux;
+}
+
+static void vinput_mux_free(struct vinput_mux *mux)
+{
+    unsigned long id;
+    struct vinput_file *vfile;
+
+    xa_for_each (&mux->files, id, vfile)
+        vinput_file_free(vfile);
+    xa_destroy(&mux->files);
+    kfree(mux->events);
+    kfree(mux);
+}
+
+/* Forget the devices gone since the last sweep, under mux->lock */
+static void vinput_mux_sweep(struct vinput_mux *mux)
+{
+    unsigned long id;
+    struct vinput_file *vfile;
+    int deaths = atomic_read(&vinput_deaths);
+
+    if (deaths == mux->deaths)
+        return;
+
+    mux->deaths = deaths;
+    xa_for_each (&mux->files, id, vfile) {
+        if (READ_ONCE(vfile->vinput->dead)) {
+            xa_erase(&mux->files, id);
+            vinput_file_free(vfile);
+        }
+    }
+}
+
+/*
+ * Look up the state of the device id, created on first use, or again when
+ * the device it was created for is gone and the id reused.
+ */
+static struct vinput_file *vinput_mux_file(struct vinput_mux *mux, u32 id)
+{
+    int err;
+    struct vinput *vinput;
+    struct vinput_file *vfile = xa_load(&mux->files, id);
+
+    if (vfile && !READ_ONCE(vfile->vinput->dead))
+        return vfile;
+    if (vfile) {
+        xa_erase(&mux->files, id);
+        vinput_file_free(vfile);
+    }
+
+    vinput = vinput_get_vdevice_by_id(id);
+    if (IS_ERR(vinput))
+        return ERR_CAST(vinput);
+    vfile = vinput_file_alloc(vinput);
+    put_device(&vinput->dev);
+    if (IS_ERR(vfile))
+        return vfile;
+
+    err = vinput_stage_alloc(vfile);
+    if (!err)
+        err = xa_err(xa_store(&mux->files, id, vfile, GFP_KERNEL));
+    if (err) {
+        vinput_file_free(vfile);
+        return ERR_PTR(err);
+    }
+
+    return vfile;
+}
+
+/* Stage a record into a frame of its device, under mux->lock */
+static int vinput_mux_event(struct vinput_mux *mux,
+                            const struct vinput_mux_event *rec)
+{
+    int idx;
+    int err;
+    struct vinput_file *vfile;
+    const struct input_event *ev = &rec->event;
+
+    if (rec->pad)
+        return -EINVAL;
+
+    vfile = vinput_mux_file(mux, rec->id);
+    if (IS_ERR(vfile))
+        return PTR_ERR(vfile);
+    xa_set_mark(&mux->files, rec->id, VINPUT_MUX_ROUTED);
+
+    if (!vinput_enter(vfile->vinput, &idx))
+        return -ENODEV;
+    err = vinput_stage_record(vfile, ev);
+    vinput_leave(idx);
+    if (err)
+        return err;
+    vfile->routed += sizeof(*rec);
+
+    if (vfile->staged)
+        xa_set_mark(&mux->files, rec->id, VINPUT_MUX_OPEN);
+    else
+        xa_clear_mark(&mux->files, rec->id, VINPUT_MUX_OPEN);
+
+    return 0;
+}
+
+/* Account the write to each device it routed records to */
+static void vinput_mux_account(struct vinput_mux *mux, int err)
+{
+    unsigned long id;
+    struct vinput_file *vfile;
+
+    xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_ROUTED) {
+        xa_clear_mark(&mux->files, id, VINPUT_MUX_ROUTED);
+        vinput_account_write(vfile->vinput, err ? err : vfile->routed);
+        vfile->routed = 0;
+    }
+}
+
+/* End the frames still open and account the write, under mux->lock */
+static void vinput_mux_flush(struct vinput_mux *mux)
+{
+    int idx;
+    unsigned long id;
+    struct vinput_file *vfile;
+
+    xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_OPEN) {
+        xa_clear_mark(&mux->files, id, VINPUT_MUX_OPEN);
+        if (!vinput_enter(vfile->vinput, &idx)) {
+            vfile->staged = 0;
+            continue;
+        }
+        if (vinput_stage_event(vfile, EV_SYN, SYN_REPORT, 0, 0))
+            vfile->staged = 0;
+        vinput_leave(idx);
+    }
+
+    vinput_mux_account(mux, 0);
+}
+
+/*
+ * Transactions: the frames of a VINPUT_IOCTL_TRANSACTION, for any number
+ * of devices, are all built and validated before any is emitted. The busy
+ * bits of the devices are then taken in id order, so that transactions
+ * sharing devices cannot deadlock, and the frames queued before are
+ * emitted. The frames of the transaction follow back to back with a single
+ * timestamp, before any other writer can emit to these devices again.
+ */
+#define VINPUT_MUX_TXN XA_MARK_1
+
+struct vinput_txn_frame {
+    struct vinput *vinput;
+    struct vinput_frame *frame;
+};
+
+/* Move the frame staged in vfile to the transaction */
+static int vinput_txn_end(struct vinput_file *vfile,
+                          struct vinput_txn_frame *txn)
+{
+    struct vinput_frame *frame = vinput_frame_alloc(vfile->staged, GFP_KERNEL);
+
+    if (!frame)
+        return -ENOMEM;
+    memcpy(frame->events, vfile->stage,
+           vfile->staged * sizeof(struct input_value));
+    frame->count = vfile->staged;
+    frame->inject_ns = ktime_get_ns();
+    vfile->staged = 0;
+    txn->vinput = vfile->vinput;
+    txn->frame = frame;
+
+    return 0;
+}
+
+/*
+ * Build the frames of count records into txn, each device marked
+ * VINPUT_MUX_TXN, and count them in *n, including on error.
+ */
+static int vinput_txn_build(struct vinput_mux *mux,
+                            const struct vinput_mux_event *recs,
+                            u32 count,
+                            struct vinput_txn_frame *txn,
+                            int *n)
+{
+    int err = 0;
+    u32 i;
+    bool sync;
+    unsigned long id;
+    struct vinput_file *vfile;
+    const struct input_event *ev;
+
+    for (i = 0; i < count; i++) {
+        ev = &recs[i].event;
+        sync = ev->type == EV_SYN && ev->code == SYN_REPORT;
+        if (recs[i].pad) {
+            err = -EINVAL;
+            break;
+        }
+
+        /* keep the devices already in, frames were built for them */
+        if (xa_get_mark(&mux->files, recs[i].id, VINPUT_MUX_TXN))
+            vfile = xa_load(&mux->files, recs[i].id);
+        else
+            vfile = vinput_mux_file(mux, recs[i].id);
+        if (IS_ERR(vfile)) {
+            err = PTR_ERR(vfile);
+            break;
+        }
+        xa_set_mark(&mux->files, recs[i].id, VINPUT_MUX_TXN);
+        xa_set_mark(&mux->files, recs[i].id, VINPUT_MUX_ROUTED);
+        vfile->routed += sizeof(recs[i]);
+
+        if (!vinput_event_supported(vfile->vinput->input, ev->type,
+                                    ev->code) ||
+            !vinput_event_time_valid(ev) ||
+            (!sync && vfile->staged == VINPUT_FRAME_MAX_EVENTS)) {
+            this_cpu_inc(vfile->vinput->stats->rejected);
+            err = -EINVAL;
+            break;
+        }
+
+        if (!sync) {
+            vfile->stage[vfile->staged++] = (struct input_value){
+                .type = ev->type,
+                .code = ev->code,
+                .value = ev->value,
+            };
+            xa_set_mark(&mux->files, recs[i].id, VINPUT_MUX_OPEN);
+            continue;
+        }
+
+        xa_clear_mark(&mux->files, recs[i].id, VINPUT_MUX_OPEN);
+        err = vinput_txn_end(vfile, &txn[*n]);
+        if (err)
+            break;
+        (*n)++;
+    }
+
+    /* end the frames left open */
+    xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_OPEN) {
+        xa_clear_mark(&mux->files, id, VINPUT_MUX_OPEN);
+        if (!err) {
+            err = vinput_txn_end(vfile, &txn[*n]);
+            *n += !err;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Take the busy bit of a device, sleeping until its consumer, maybe a
+ * preempted writer or a player timer, releases it, and emit the frames
+ * queued before.
+ */
+static void vinput_txn_lock(struct vinput *vinput)
+{
+    wait_event(vinput->busy_wait,
+               !test_and_set_bit(VINPUT_BUSY, &vinput->flags));
+
+    vinput_frame_drain(vinput);
+}
+
+static void vinput_txn_unlock(struct vinput *vinput)
+{
+    vinput_frame_unlock(vinput);
+
+    /* emit the frames queued by others meanwhile */
+    vinput_frame_flush(vinput);
+}
+
+/* Run a transaction of count records, under mux->lock */
+static int vinput_mux_transaction(struct vinput_mux *mux,
+                                  const struct vinput_mux_event *recs,
+                                  u32 count)
+{
+    int i, err;
+    int idx;
+    int n = 0;
+    ktime_t now;
+    unsigned long id;
+    struct vinput_file *vfile;
+    struct vinput_txn_frame *txn;
+
+    txn = kvmalloc_array(count, sizeof(*txn), GFP_KERNEL);
+    if (!txn)
+        return -ENOMEM;
+
+    vinput_mux_sweep(mux);
+
+    /* unexport waits for the end of the transaction */
+    idx = srcu_read_lock(&vinput_srcu);
+    err = vinput_txn_build(mux, recs, count, txn, &n);
+    if (err) {
+        xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_TXN) {
+            xa_clear_mark(&mux->files, id, VINPUT_MUX_OPEN);
+            xa_clear_mark(&mux->files, id, VINPUT_MUX_TXN);
+            vfile->staged = 0;
+        }
+        goto out;
+    }
+
+    xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_TXN)
+        vinput_txn_lock(vfile->vinput);
+
+    now = ktime_get();
+    for (i = 0; i < n; i++) {
+        txn[i].frame->timestamp = now;
+        vinput_frame_emit(txn[i].vinput, txn[i].frame);
+    }
+
+    xa_for_each_marked (&mux->files, id, vfile, VINPUT_MUX_TXN) {
+        xa_clear_mark(&mux->files, id, VINPUT_MUX_TXN);
+        vinput_txn_unlock(vfile->vinput);
+    }
+
+out:
+    vinput_mux_account(mux, err);
+    srcu_read_unlock(&vinput_srcu, idx);
+    for (i = 0; i < n; i++)
+        kfree(txn[i].frame);
+    kvfree(txn);
+
+    return err;
+}
+
+static int vinput_mux_open(struct inode *inode, struct file *file)
+{
+    struct vinput_mux *mux;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    mux = vinput_mux_alloc();
+    if (!mux)
+        return -ENOMEM;
+    file->private_data = mux;
+
+    return 0;
+}
+
+static int vinput_mux_release(struct inode *inode, struct file *file)
+{
+    vinput_mux_free(file->private_data);
+    return 0;
+}
+
+static ssize_t vinput_mux_write(struct file *file,
+                                const char __user *buffer,
+                                size_t count,
+                                loff_t *offset)
+{
+    int i, n;
+    int err = 0;
+    size_t done = 0;
+    struct vinput_mux *mux = file->private_data;
+
+    if (vinput_compat_events() || count % sizeof(struct vinput_mux_event))
+        return -EINVAL;
+
+    mutex_lock(&mux->lock);
+    vinput_mux_sweep(mux);
+    while (done < count) {
+        n = min_t(size_t, (count - done) / sizeof(struct vinput_mux_event),
+                  VINPUT_BATCH);
+
+        if (copy_from_user(mux->events, buffer + done,
+                           n * sizeof(struct vinput_mux_event))) {
+            err = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            err = vinput_mux_event(mux, &mux->events[i]);
+            if (err)
+                break;
+        }
+
+        done += i * sizeof(struct vinput_mux_event);
+        if (err)
+            break;
+    }
+    vinput_mux_flush(mux);
+    mutex_unlock(&mux->lock);
+
+    return done ? done : err;
+}
+
+static long vinput_mux_ioctl(struct file *file,
+                             unsigned int cmd,
+                             unsigned long arg)
+{
+    int err;
+    struct vinput_transaction txn;
+    struct vinput_mux_event *recs;
+    struct vinput_mux *mux = file->private_data;
+
+    if (cmd != VINPUT_IOCTL_TRANSACTION)
+        return -ENOTTY;
+    if (copy_from_user(&txn, (void __user *) arg, sizeof(txn)))
+        return -EFAULT;
+    if (vinput_compat_events() || txn.flags || !txn.count ||
+        txn.count > VINPUT_TRANSACTION_MAX_EVENTS)
+        return -EINVAL;
+
+    recs = kvmalloc_array(txn.count, sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+    if (copy_from_user(recs, u64_to_user_ptr(txn.events),
+                       txn.count * sizeof(*recs))) {
+        kvfree(recs);
+        return -EFAULT;
+    }
+
+    mutex_lock(&mux->lock);
+    err = vinput_mux_transaction(mux, recs, txn.count);
+    mutex_unlock(&mux->lock);
+    kvfree(recs);
+
+    return err;
+}
+
+static const struct file_operations vinput_mux_fops = {
+    .owner = THIS_MODULE,
+    .open = vinput_mux_open,
+    .release = vinput_mux_release,
+    .write = vinput_mux_write,
+    .unlocked_ioctl = vinput_mux_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice vinput_mux = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "vinput-mux",
+    .fops = &vinput_mux_fops,
+    .mode = 0600,
+};
+
+static int __init vinput_init(void)
+{
+    int err = 0;
+
+    pr_info("vinput: Loading virtual input driver\n");
+
+    if (!max_devices || max_devices > MINORMASK + 1) {
+        pr_err("vinput: max_devices must be between 1 and %u\n",
+               MINORMASK + 1);
+        return -EINVAL;
+    }
+
+    if (capture_size > VINPUT_CAPTURE_MAX ||
+        (capture_size && !is_power_of_2(capture_size))) {
+        pr_err("vinput: capture_size must be 0 or a power of 2 up to %u\n",
+               VINPUT_CAPTURE_MAX);
+        return -EINVAL;
+    }
+
+    err = alloc_chrdev_region(&vinput_devt, 0, max_devices, DRIVER_NAME);
+    if (err < 0) {
+        pr_err("vinput: Unable to allocate char dev region\n");
+        goto failed_alloc;
+    }
+
+    spin_lock_init(&vinput_lock);
+
+    vinput_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+
+    vinput_wq = alloc_workqueue(DRIVER_NAME, WQ_UNBOUND, 0);
+    if (!vinput_wq) {
+        err = -ENOMEM;
+        goto failed_wq;
+    }
+
+    err = class_register(&vinput_class);
+    if (err < 0) {
+        pr_err("vinput: Unable to register vinput class\n");
+        goto failed_class;
+    }
+
+    if (latency_probe) {
+        err = input_register_handler(&vinput_probe_handler);
+        if (err < 0) {
+            pr_err("vinput: Unable to register latency probe\n");
+            goto failed_probe;
+        }
+    }
+
+    err = vinput_configfs_init();
+    if (err < 0) {
+        pr_err("vinput: Unable to register configfs subsystem\n");
+        goto failed_configfs;
+    }
+
+    err = misc_register(&vinput_control);
+    if (err < 0) {
+        pr_err("vinput: Unable to register control node\n");
+        goto failed_control;
+    }
+
+    err = misc_register(&vinput_mux);
+    if (err < 0) {
+        pr_err("vinput: Unable to register mux node\n");
+        goto failed_mux;
+    }
+
+    return 0;
+failed_mux:
+    misc_deregister(&vinput_control);
+failed_control:
+    vinput_configfs_exit();
+failed_configfs:
+    if (latency_probe)
+        input_unregister_handler(&vinput_probe_handler);
+failed_probe:
+    class_unregister(&vinput_class);
+failed_class:
+    destroy_workqueue(vinput_wq);
+failed_wq:
+    debugfs_remove_recursive(vinput_debugfs);
+    unregister_chrdev_region(vinput_devt, max_devices);
+failed_alloc:
+    return err;
 }
 
 static void __exit vinput_end(void)
 {
     pr_info("vinput: Unloading virtual input driver\n");
 
-    unregister_chrdev(vinput_dev, DRIVER_NAME);
+    misc_deregister(&vinput_mux);
+    misc_deregister(&vinput_control);
+    vinput_configfs_exit();
+    if (latency_probe)
+        input_unregister_handler(&vinput_probe_handler);
+
+    destroy_workqueue(vinput_wq);
+    debugfs_remove_recursive(vinput_debugfs);
+    unregister_chrdev_region(vinput_devt, max_devices);
     class_unregister(&vinput_class);
 }
 
@@ -396,3 +4148,7 @@ module_exit(vinput_end);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tristan Lelong <tristan.lelong@blunderer.org>");
 MODULE_DESCRIPTION("Emulate input events");
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+#include "vinput_test.c"
+#endif
@@ -1,29 +1,91 @@
 #ifndef VINPUT_H
 #define VINPUT_H
 
+#include <linux/cdev.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
+#include <linux/llist.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
 
 #define VINPUT_MAX_LEN 128
-#define MAX_VINPUT 32
-#define VINPUT_MINORS MAX_VINPUT
+#define VINPUT_MAX_DEVICES 1024
+#define VINPUT_NAME_LEN 32
 
 #define dev_to_vinput(dev) container_of(dev, struct vinput, dev)
 
+struct vinput_config;
 struct vinput_device;
+struct vinput_macros;
+struct vinput_record;
+struct vinput_stats;
 
 struct vinput {
     long id;
     long devno;
     long last_entry;
     spinlock_t lock;
+    bool dead;
+    /* created by a control file and only reachable through it */
+    bool owned;
+    unsigned int frame_len;
+
+    /* frames queued by producers, see vinput_frame_flush() */
+    struct llist_head frames;
+    unsigned long flags;
+    /* transactions waiting for the consumer to leave */
+    wait_queue_head_t busy_wait;
+
+    /* capture ring of the emitted events, see vinput_capture() */
+    spinlock_t capture_lock;
+    struct vinput_record *capture;
+    unsigned int capture_size;
+    u64 capture_head;
+    u64 capture_tail;
+    wait_queue_head_t capture_wait;
+
+    /* macros uploaded through sysfs, see vinput_macro_trigger() */
+    struct vinput_macros *macros;
 
     void *priv_data;
+    /* configfs description of the device, only during the init op */
+    const struct vinput_config *config;
+    char name[VINPUT_NAME_LEN];
 
     struct device dev;
+    struct cdev cdev;
     struct list_head list;
     struct input_dev *input;
     struct vinput_device *type;
+    struct rcu_head rcu;
+
+    struct vinput_stats __percpu *stats;
+    struct dentry *debugfs;
+    /* inject time of the frame being emitted, set by its consumer */
+    u64 inject_ns;
+};
+
+/*
+ * Description of a device created through configfs, fields being -1, or
+ * empty, when unset. Drivers apply what they support in their init op and
+ * fail it when something they need is missing.
+ */
+/* most contacts a touchscreen may track */
+#define VINPUT_MAX_POINTS 64
+
+struct vinput_config {
+    char name[VINPUT_NAME_LEN];
+    int vendor;
+    int product;
+    int version;
+    /* multitouch protocol, 'A' or 'B' */
+    char mt_type;
+    int max_x;
+    int max_y;
+    int max_z;
+    int max_points;
+    /* keys reported instead of the default ones of the driver */
+    unsigned long keys[BITS_TO_LONGS(KEY_CNT)];
 };
 
 struct vinput_ops {
@@ -39,7 +101,81 @@ struct vinput_device {
     struct vinput_ops *ops;
 };
 
+/* report pointer emulation from the MT slots before the frame is synced */
+#define VINPUT_FRAME_MT_POINTER 0x1
+/* end the frame with input_mt_sync_frame(), for type B devices */
+#define VINPUT_FRAME_MT_SYNC 0x2
+
+/*
+ * A frame of events to emit atomically, up to the input_sync() that the
+ * consumer adds after them.
+ */
+struct vinput_frame {
+    struct llist_node node;
+    unsigned int flags;
+    unsigned int count;
+    unsigned int size;
+    /* CLOCK_MONOTONIC time to stamp the frame with, 0 for its emission */
+    ktime_t timestamp;
+    /* CLOCK_MONOTONIC ns the frame was queued at, for the latency stats */
+    u64 inject_ns;
+    struct input_value events[];
+};
+
+/*
+ * Timed emission of frames from an hrtimer. next() runs in softirq context
+ * and returns the following frame along with its offset in ns from the
+ * start of the playback, or NULL at the end. Offsets are scaled by the
+ * speed, in permille; a speed of 0 plays the frames as fast as possible.
+ */
+struct vinput_player {
+    struct hrtimer timer;
+    struct vinput *vinput;
+    struct vinput_frame *(*next)(struct vinput_player *player, u64 *when);
+
+    struct vinput_frame *frame;
+    u64 when;
+    ktime_t start;
+    unsigned int speed;
+    bool running;
+    /* stamp frames with their schedule at 1x rather than their emission */
+    bool stamp;
+
+    /* frames played, and how late they were */
+    u32 played;
+    u64 late_max;
+    u64 late_sum;
+};
+
 int vinput_register(struct vinput_device *dev);
 void vinput_unregister(struct vinput_device *dev);
 
+struct vinput_frame *vinput_frame_alloc(unsigned int size, gfp_t gfp);
+void vinput_frame_add(struct vinput_frame *frame,
+                      unsigned int type,
+                      unsigned int code,
+                      int value);
+void vinput_frame_queue(struct vinput *vinput, struct vinput_frame *frame);
+void vinput_frame_flush(struct vinput *vinput);
+void vinput_frame_submit(struct vinput *vinput, struct vinput_frame *frame);
+
+void vinput_player_init(struct vinput_player *player,
+                        struct vinput *vinput,
+                        struct vinput_frame *(*next)(struct vinput_player *,
+                                                     u64 *));
+void vinput_player_start(struct vinput_player *player, unsigned int speed);
+void vinput_player_stop(struct vinput_player *player);
+void vinput_parse_error(struct vinput *vinput,
+                        const char *buff,
+                        int len,
+                        int pos,
+                        int err);
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+struct vinput *vinput_test_create(struct vinput_device *type);
+struct vinput *vinput_test_create_config(struct vinput_device *type,
+                                         const struct vinput_config *config);
+void vinput_test_destroy(struct vinput *vinput);
+#endif
+
 #endif
@@ -0,0 +1,145 @@
+#ifndef VINPUT_PARSE_H
+#define VINPUT_PARSE_H
+
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/types.h>
+
+#include "vinput.h"
+
+/*
+ * Single pass parser for the text commands of the vinput drivers.
+ *
+ * A command is a list of records separated by ';', each record a list of
+ * decimal integers separated by ','. The parser walks the buffer once,
+ * never copies nor modifies it, and stops at the first error, which is
+ * kept with the offset it was found at. Whitespace is not accepted, only
+ * a single trailing newline.
+ */
+struct vinput_parser {
+    const char *buff;
+    const char *pos;
+    const char *end;
+    int err;
+};
+
+static inline void vinput_parser_init(struct vinput_parser *p,
+                                      const char *buff,
+                                      int len)
+{
+    p->buff = buff;
+    p->pos = buff;
+    p->end = buff + len;
+    p->err = 0;
+}
+
+static inline int vinput_parser_fail(struct vinput_parser *p, int err)
+{
+    if (!p->err)
+        p->err = err;
+    return p->err;
+}
+
+/* Parse an optionally signed decimal int at the cursor */
+static inline int vinput_parse_int(struct vinput_parser *p, int *val)
+{
+    unsigned int d;
+    unsigned int acc = 0;
+    unsigned int limit = INT_MAX;
+    bool neg = false;
+    const char *s = p->pos;
+
+    if (p->err)
+        return p->err;
+
+    if (s < p->end && (*s == '-' || *s == '+')) {
+        neg = *s++ == '-';
+        limit += neg;
+    }
+    if (s == p->end || (unsigned int) (*s - '0') > 9) {
+        p->pos = s;
+        return vinput_parser_fail(p, -EINVAL);
+    }
+
+    do {
+        d = *s - '0';
+        if (d > 9)
+            break;
+        if (acc > (limit - d) / 10) {
+            p->pos = s;
+            return vinput_parser_fail(p, -ERANGE);
+        }
+        acc = acc * 10 + d;
+    } while (++s < p->end);
+
+    *val = neg ? (int) (0U - acc) : (int) acc;
+    p->pos = s;
+
+    return 0;
+}
+
+/* Consume the separator c at the cursor */
+static inline int vinput_parse_sep(struct vinput_parser *p, char c)
+{
+    if (p->err)
+        return p->err;
+    if (p->pos == p->end || *p->pos != c)
+        return vinput_parser_fail(p, -EINVAL);
+    p->pos++;
+
+    return 0;
+}
+
+/* Parse n comma separated ints */
+static inline int vinput_parse_fields(struct vinput_parser *p,
+                                      int *vals,
+                                      int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (i)
+            vinput_parse_sep(p, ',');
+        vinput_parse_int(p, &vals[i]);
+    }
+
+    return p->err;
+}
+
+/* Whether the end of the command, or its trailing newline, is reached */
+static inline bool vinput_parse_eol(struct vinput_parser *p)
+{
+    return p->pos == p->end || (*p->pos == '\n' && p->pos + 1 == p->end);
+}
+
+/*
+ * Step over the ';' ending a record. Returns false at the end of the
+ * command, or when the record is followed by anything else, in which case
+ * the parser fails.
+ */
+static inline bool vinput_parse_next(struct vinput_parser *p)
+{
+    if (p->err || vinput_parse_eol(p))
+        return false;
+
+    return !vinput_parse_sep(p, ';');
+}
+
+/* Check that the whole command was consumed */
+static inline int vinput_parse_end(struct vinput_parser *p)
+{
+    if (!p->err && !vinput_parse_eol(p))
+        vinput_parser_fail(p, -EINVAL);
+
+    return p->err;
+}
+
+/* Report the error of a parser to vinput:parse_error */
+static inline void vinput_parser_error(struct vinput *vinput,
+                                       struct vinput_parser *p)
+{
+    vinput_parse_error(vinput, p->buff, p->end - p->buff, p->pos - p->buff,
+                       p->err);
+}
+
+#endif
@@ -0,0 +1,893 @@
+/*
+ * KUnit tests for the vinput core, included at the end of vinput.c when
+ * CONFIG_VINPUT_KUNIT_TEST is enabled.
+ */
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+
+#include "vinput_parse.h"
+
+#define VINPUT_TEST_LOOPS 100000
+
+static void vinput_test_parse_int(struct kunit *test)
+{
+    int val;
+    struct vinput_parser p;
+    static const struct {
+        const char *str;
+        int err;
+        int val;
+        int pos;
+    } cases[] = {
+        { "0", 0, 0, 1 },
+        { "42", 0, 42, 2 },
+        { "+42", 0, 42, 3 },
+        { "-42", 0, -42, 3 },
+        { "2147483647", 0, INT_MAX, 10 },
+        { "-2147483648", 0, INT_MIN, 11 },
+        { "2147483648", -ERANGE, 0, 9 },
+        { "-2147483649", -ERANGE, 0, 10 },
+        { "", -EINVAL, 0, 0 },
+        { "-", -EINVAL, 0, 1 },
+        { "+-1", -EINVAL, 0, 1 },
+        { " 1", -EINVAL, 0, 0 },
+        { "x1", -EINVAL, 0, 0 },
+        { "12,", 0, 12, 2 },
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        val = 0;
+        vinput_parser_init(&p, cases[i].str, strlen(cases[i].str));
+        KUNIT_EXPECT_EQ_MSG(test, vinput_parse_int(&p, &val), cases[i].err,
+                            "\"%s\"", cases[i].str);
+        KUNIT_EXPECT_EQ_MSG(test, (int) (p.pos - p.buff), cases[i].pos,
+                            "\"%s\"", cases[i].str);
+        if (!cases[i].err)
+            KUNIT_EXPECT_EQ_MSG(test, val, cases[i].val, "\"%s\"",
+                                cases[i].str);
+    }
+}
+
+static void vinput_test_parse_fields(struct kunit *test)
+{
+    int v[4];
+    struct vinput_parser p;
+    const char *str = "1,-2,3,40\n";
+
+    vinput_parser_init(&p, str, strlen(str));
+    KUNIT_EXPECT_EQ(test, vinput_parse_fields(&p, v, 4), 0);
+    KUNIT_EXPECT_EQ(test, vinput_parse_end(&p), 0);
+    KUNIT_EXPECT_EQ(test, v[0], 1);
+    KUNIT_EXPECT_EQ(test, v[1], -2);
+    KUNIT_EXPECT_EQ(test, v[2], 3);
+    KUNIT_EXPECT_EQ(test, v[3], 40);
+
+    /* missing field: the error points past the last comma */
+    str = "1,2,3";
+    vinput_parser_init(&p, str, strlen(str));
+    KUNIT_EXPECT_EQ(test, vinput_parse_fields(&p, v, 4), -EINVAL);
+    KUNIT_EXPECT_EQ(test, (int) (p.pos - p.buff), 5);
+
+    /* trailing garbage */
+    str = "1,2,3,4 ";
+    vinput_parser_init(&p, str, strlen(str));
+    KUNIT_EXPECT_EQ(test, vinput_parse_fields(&p, v, 4), 0);
+    KUNIT_EXPECT_EQ(test, vinput_parse_end(&p), -EINVAL);
+    KUNIT_EXPECT_EQ(test, (int) (p.pos - p.buff), 7);
+
+    /* the length bounds the parser, not a terminating NUL */
+    str = "1,2,3,45";
+    vinput_parser_init(&p, str, 7);
+    KUNIT_EXPECT_EQ(test, vinput_parse_fields(&p, v, 4), 0);
+    KUNIT_EXPECT_EQ(test, v[3], 4);
+}
+
+static void vinput_test_parse_records(struct kunit *test)
+{
+    int v[2];
+    int n = 0;
+    int sum = 0;
+    struct vinput_parser p;
+    const char *str = "1,2;3,4;5,6";
+
+    vinput_parser_init(&p, str, strlen(str));
+    do {
+        if (vinput_parse_fields(&p, v, 2))
+            break;
+        sum += v[0] * v[1];
+        n++;
+    } while (vinput_parse_next(&p));
+    KUNIT_EXPECT_EQ(test, vinput_parse_end(&p), 0);
+    KUNIT_EXPECT_EQ(test, n, 3);
+    KUNIT_EXPECT_EQ(test, sum, 44);
+
+    /* an empty record after a separator */
+    str = "1,2;";
+    vinput_parser_init(&p, str, strlen(str));
+    do {
+        if (vinput_parse_fields(&p, v, 2))
+            break;
+    } while (vinput_parse_next(&p));
+    KUNIT_EXPECT_EQ(test, vinput_parse_end(&p), -EINVAL);
+    KUNIT_EXPECT_EQ(test, (int) (p.pos - p.buff), 4);
+
+    /* a record ended by something other than ';' */
+    str = "1,2:3,4";
+    vinput_parser_init(&p, str, strlen(str));
+    vinput_parse_fields(&p, v, 2);
+    KUNIT_EXPECT_FALSE(test, vinput_parse_next(&p));
+    KUNIT_EXPECT_EQ(test, p.err, -EINVAL);
+    KUNIT_EXPECT_EQ(test, (int) (p.pos - p.buff), 3);
+}
+
+/* vinput_parse_fields() against the sscanf() the drivers used to call */
+static void vinput_test_parse_speed(struct kunit *test)
+{
+    int i;
+    int v[4];
+    u64 start, parser, scanf;
+    struct vinput_parser p;
+    const char *str = "1234,-567,89,1";
+    int len = strlen(str);
+
+    start = ktime_get_ns();
+    for (i = 0; i < VINPUT_TEST_LOOPS; i++) {
+        vinput_parser_init(&p, str, len);
+        vinput_parse_fields(&p, v, 4);
+        vinput_parse_end(&p);
+        OPTIMIZER_HIDE_VAR(v[3]);
+    }
+    parser = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < VINPUT_TEST_LOOPS; i++) {
+        sscanf(str, "%d,%d,%d,%d", &v[0], &v[1], &v[2], &v[3]);
+        OPTIMIZER_HIDE_VAR(v[3]);
+    }
+    scanf = ktime_get_ns() - start;
+
+    kunit_info(test, "parser: %llu ns, sscanf: %llu ns per 4-field record\n",
+               div_u64(parser, VINPUT_TEST_LOOPS),
+               div_u64(scanf, VINPUT_TEST_LOOPS));
+}
+
+static int vinput_test_kbd_init(struct vinput *vinput)
+{
+    __set_bit(EV_KEY, vinput->input->evbit);
+    __set_bit(KEY_A, vinput->input->keybit);
+
+    return input_register_device(vinput->input);
+}
+
+/* "1" presses KEY_A and "0" releases it */
+static int vinput_test_kbd_send(struct vinput *vinput, char *buff, int len)
+{
+    struct vinput_frame *frame;
+
+    if (len != 1 || (buff[0] != '0' && buff[0] != '1'))
+        return -EINVAL;
+
+    frame = vinput_frame_alloc(1, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+    vinput_frame_add(frame, EV_KEY, KEY_A, buff[0] - '0');
+    vinput_frame_submit(vinput, frame);
+
+    return len;
+}
+
+static struct vinput_ops vinput_test_ops = {
+    .init = vinput_test_kbd_init,
+    .send = vinput_test_kbd_send,
+};
+
+static struct vinput_device vinput_test_dev = {
+    .name = "vinput-test",
+    .ops = &vinput_test_ops,
+};
+
+static void vinput_test_submit_key(struct kunit *test,
+                                   struct vinput *vinput,
+                                   int value)
+{
+    struct vinput_frame *frame = vinput_frame_alloc(1, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, frame);
+    vinput_frame_add(frame, EV_KEY, KEY_A, value);
+    vinput_frame_submit(vinput, frame);
+}
+
+/* frames queued while another writer emits are emitted by it, in order */
+static void vinput_test_frame_queue(struct kunit *test)
+{
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+
+    vinput_test_submit_key(test, vinput, 1);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+    KUNIT_EXPECT_TRUE(test, llist_empty(&vinput->frames));
+
+    /* pretend another writer is the consumer */
+    set_bit(VINPUT_BUSY, &vinput->flags);
+    vinput_test_submit_key(test, vinput, 0);
+    vinput_test_submit_key(test, vinput, 1);
+    vinput_test_submit_key(test, vinput, 0);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+    KUNIT_EXPECT_FALSE(test, llist_empty(&vinput->frames));
+
+    clear_bit(VINPUT_BUSY, &vinput->flags);
+    vinput_frame_flush(vinput);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+    KUNIT_EXPECT_TRUE(test, llist_empty(&vinput->frames));
+
+    vinput_test_destroy(vinput);
+}
+
+/* text is sent line by line, across writes, up to the first bad line */
+static void vinput_test_write_text(struct kunit *test)
+{
+    size_t sent;
+    char *line;
+    struct vinput_file *vfile;
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    vfile = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vfile));
+
+    /* a partial line is kept until a later write completes it */
+    sent = 0;
+    KUNIT_EXPECT_EQ(test, vinput_write_lines(vfile, "1", 1, &sent), 0);
+    KUNIT_EXPECT_EQ(test, sent, (size_t) 0);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, vinput_write_lines(vfile, "\n0", 2, &sent), 0);
+    KUNIT_EXPECT_EQ(test, sent, (size_t) 1);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, vfile->line_len, 1);
+    sent = 0;
+    KUNIT_EXPECT_EQ(test, vinput_write_lines(vfile, "\n", 1, &sent), 0);
+    KUNIT_EXPECT_EQ(test, sent, (size_t) 1);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* an over-long line fails whole and leaves nothing pending */
+    line = kunit_kzalloc(test, VINPUT_MAX_LEN + 2, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, line);
+    memset(line, '1', VINPUT_MAX_LEN + 1);
+    line[VINPUT_MAX_LEN + 1] = '\n';
+    sent = 0;
+    KUNIT_EXPECT_EQ(test,
+                    vinput_write_lines(vfile, line, VINPUT_MAX_LEN + 2, &sent),
+                    -EINVAL);
+    KUNIT_EXPECT_EQ(test, sent, (size_t) 0);
+    KUNIT_EXPECT_EQ(test, vfile->line_len, 0);
+    KUNIT_EXPECT_FALSE(test, vfile->overflow);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* a bad line stops the buffer, the lines before it are sent */
+    sent = 0;
+    KUNIT_EXPECT_EQ(test, vinput_write_lines(vfile, "1\nx\n0\n", 6, &sent),
+                    -EINVAL);
+    KUNIT_EXPECT_EQ(test, sent, (size_t) 2);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+
+    vinput_file_free(vfile);
+    vinput_test_destroy(vinput);
+}
+
+static u64 vinput_test_rejected(struct vinput *vinput)
+{
+    int cpu;
+    u64 rejected = 0;
+
+    for_each_possible_cpu (cpu)
+        rejected += per_cpu_ptr(vinput->stats, cpu)->rejected;
+
+    return rejected;
+}
+
+/* binary records are staged up to the first invalid one */
+static void vinput_test_write_events(struct kunit *test)
+{
+    int i, err;
+    struct input_event *ev;
+    struct vinput_file *vfile;
+    const struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT };
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    vfile = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vfile));
+    KUNIT_ASSERT_EQ(test, vinput_set_mode(vfile, VINPUT_MODE_BINARY), 0);
+    ev = kunit_kcalloc(test, VINPUT_FRAME_MAX_EVENTS + 1, sizeof(*ev),
+                       GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ev);
+
+    /* a frame is emitted at its SYN_REPORT */
+    ev[0] = (struct input_event){ .type = EV_KEY, .code = KEY_A, .value = 1 };
+    ev[1] = syn;
+    ev[1].input_event_usec = USEC_PER_SEC - 1;
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, ev, 2, &err), 2);
+    KUNIT_EXPECT_EQ(test, err, 0);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* unsupported codes and types and bad times stop the records */
+    ev[0] = (struct input_event){ .type = EV_KEY, .code = KEY_A, .value = 0 };
+    ev[1] = (struct input_event){ .type = EV_KEY, .code = KEY_B, .value = 1 };
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, ev, 2, &err), 1);
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    ev[0] = (struct input_event){ .type = EV_REL, .code = REL_X, .value = 1 };
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, ev, 1, &err), 0);
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    ev[0] = syn;
+    ev[0].input_event_usec = USEC_PER_SEC;
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, ev, 1, &err), 0);
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    ev[0].input_event_usec = -1;
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, ev, 1, &err), 0);
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_test_rejected(vinput), 4ULL);
+
+    /* the record staged before them is still in its frame */
+    KUNIT_EXPECT_EQ(test, vfile->staged, 1U);
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, &syn, 1, &err), 1);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* a frame holds up to VINPUT_FRAME_MAX_EVENTS records */
+    for (i = 0; i <= VINPUT_FRAME_MAX_EVENTS; i++)
+        ev[i] = (struct input_event){
+            .type = EV_KEY,
+            .code = KEY_A,
+            .value = 1,
+        };
+    KUNIT_EXPECT_EQ(test,
+                    vinput_stage_events(vfile, ev, VINPUT_FRAME_MAX_EVENTS + 1,
+                                        &err),
+                    VINPUT_FRAME_MAX_EVENTS);
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_stage_events(vfile, &syn, 1, &err), 1);
+    KUNIT_EXPECT_EQ(test, vfile->staged, 0U);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+
+    vinput_file_free(vfile);
+    vinput_test_destroy(vinput);
+}
+
+static void vinput_test_capture(struct kunit *test)
+{
+    struct vinput_record recs[8];
+    struct vinput_frame *frame;
+    struct vinput_file vfile = {};
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(vinput, 3), -EINVAL);
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(vinput, 4), 0);
+    vfile.vinput = vinput;
+
+    /* a frame is recorded with its SYN_REPORT */
+    vinput_test_submit_key(test, vinput, 1);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(&vfile, recs, 8), 2);
+    KUNIT_EXPECT_EQ(test, recs[0].v.code, KEY_A);
+    KUNIT_EXPECT_EQ(test, recs[0].v.value, 1);
+    KUNIT_EXPECT_EQ(test, recs[1].v.code, SYN_REPORT);
+    KUNIT_EXPECT_EQ(test, recs[0].time, recs[1].time);
+    KUNIT_EXPECT_EQ(test, vinput_capture_take(&vfile, recs, 8), 0);
+
+    /* 6 records overflow the ring of 4, the oldest 2 are dropped */
+    vinput_test_submit_key(test, vinput, 0);
+    vinput_test_submit_key(test, vinput, 1);
+    vinput_test_submit_key(test, vinput, 0);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(&vfile, recs, 8), 5);
+    KUNIT_EXPECT_EQ(test, recs[0].v.type, EV_SYN);
+    KUNIT_EXPECT_EQ(test, recs[0].v.code, SYN_DROPPED);
+    KUNIT_EXPECT_EQ(test, recs[0].v.value, 2);
+    KUNIT_EXPECT_EQ(test, recs[1].v.value, 1);
+    KUNIT_EXPECT_EQ(test, recs[3].v.value, 0);
+
+    /* a frame stamped by its producer is recorded at that time */
+    frame = vinput_frame_alloc(1, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, frame);
+    vinput_frame_add(frame, EV_KEY, KEY_A, 1);
+    frame->timestamp = ns_to_ktime(42000);
+    vinput_frame_submit(vinput, frame);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(&vfile, recs, 8), 2);
+    KUNIT_EXPECT_EQ(test, recs[0].time, 42000ULL);
+    KUNIT_EXPECT_EQ(test, recs[1].time, 42000ULL);
+
+    vinput_test_destroy(vinput);
+}
+
+/* each file reads the capture ring at its own cursor */
+static void vinput_test_capture_files(struct kunit *test)
+{
+    struct vinput_record recs[8];
+    struct file fa = {}, fb = {};
+    struct vinput_file *a, *b;
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(vinput, 4), 0);
+    a = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    b = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+    fa.private_data = a;
+    fb.private_data = b;
+
+    /* readable once a frame is recorded */
+    KUNIT_EXPECT_FALSE(test, vinput_poll(&fa, NULL) & EPOLLIN);
+    vinput_test_submit_key(test, vinput, 1);
+    KUNIT_EXPECT_TRUE(test, vinput_poll(&fa, NULL) & EPOLLIN);
+    KUNIT_EXPECT_TRUE(test, vinput_poll(&fb, NULL) & EPOLLIN);
+
+    /* reading from a leaves the cursor of b in place */
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(a, recs, 8), 2);
+    KUNIT_EXPECT_EQ(test, a->cursor, vinput->capture_head);
+    KUNIT_EXPECT_EQ(test, b->cursor, 0ULL);
+    KUNIT_EXPECT_FALSE(test, vinput_poll(&fa, NULL) & EPOLLIN);
+    KUNIT_EXPECT_TRUE(test, vinput_poll(&fb, NULL) & EPOLLIN);
+
+    /* 4 more records: a keeps up, b is overrun by 2 */
+    vinput_test_submit_key(test, vinput, 0);
+    vinput_test_submit_key(test, vinput, 1);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(a, recs, 8), 4);
+    KUNIT_EXPECT_EQ(test, recs[0].v.code, KEY_A);
+    KUNIT_EXPECT_EQ(test, recs[0].v.value, 0);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(b, recs, 8), 5);
+    KUNIT_EXPECT_EQ(test, recs[0].v.code, SYN_DROPPED);
+    KUNIT_EXPECT_EQ(test, recs[0].v.value, 2);
+    KUNIT_EXPECT_EQ(test, recs[1].v.code, KEY_A);
+    KUNIT_EXPECT_EQ(test, a->cursor, b->cursor);
+    KUNIT_EXPECT_FALSE(test, vinput_poll(&fb, NULL) & EPOLLIN);
+
+    /* readers of a dead device see a hangup */
+    vinput_test_destroy(vinput);
+    KUNIT_EXPECT_EQ(test, vinput_poll(&fa, NULL),
+                    (__poll_t) (EPOLLHUP | EPOLLERR));
+    vinput_file_free(a);
+    vinput_file_free(b);
+}
+
+/* the shared ring is drained up to the head published by userspace */
+static void vinput_test_ring(struct kunit *test)
+{
+    struct vinput_ring_setup setup = { .entries = 3 };
+    struct vinput_ring_buf *ring;
+    struct vinput_file *vfile;
+    const struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT };
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    vfile = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vfile));
+    KUNIT_EXPECT_EQ(test, vinput_ring_setup(vfile, &setup), -EINVAL);
+    setup.entries = 4;
+    KUNIT_ASSERT_EQ(test, vinput_ring_setup(vfile, &setup), 0);
+    KUNIT_EXPECT_EQ(test, vinput_ring_setup(vfile, &setup), -EBUSY);
+    ring = vfile->ring;
+
+    /* an unsupported record is skipped and counted */
+    ring->events[0] =
+        (struct input_event){ .type = EV_KEY, .code = KEY_A, .value = 1 };
+    ring->events[1] =
+        (struct input_event){ .type = EV_KEY, .code = KEY_B, .value = 1 };
+    ring->events[2] = syn;
+    smp_store_release(&ring->hdr->head, 3);
+    mutex_lock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, vinput_ring_drain(vfile), 3);
+    mutex_unlock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, ring->hdr->tail, 3U);
+    KUNIT_EXPECT_EQ(test, ring->hdr->rejected, 1ULL);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* records wrap around the end of the ring */
+    ring->events[3] =
+        (struct input_event){ .type = EV_KEY, .code = KEY_A, .value = 0 };
+    ring->events[0] = syn;
+    smp_store_release(&ring->hdr->head, 5);
+    mutex_lock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, vinput_ring_drain(vfile), 2);
+    KUNIT_EXPECT_EQ(test, vinput_ring_drain(vfile), 0);
+    mutex_unlock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, ring->hdr->tail, 5U);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* a head more than a ring ahead of the tail is refused */
+    smp_store_release(&ring->hdr->head, 10);
+    mutex_lock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, vinput_ring_drain(vfile), -EINVAL);
+    mutex_unlock(&vfile->lock);
+    KUNIT_EXPECT_EQ(test, ring->hdr->tail, 5U);
+
+    vinput_file_free(vfile);
+    vinput_test_destroy(vinput);
+}
+
+static void vinput_test_replay(struct kunit *test)
+{
+    int i;
+    struct vinput_replay_buf *replay;
+    struct input_event events[] = {
+        { .type = EV_KEY, .code = KEY_A, .value = 1 },
+        { .type = EV_SYN, .code = SYN_REPORT },
+        { .type = EV_KEY, .code = KEY_A, .value = 0 },
+        { .type = EV_SYN, .code = SYN_REPORT },
+        { .type = EV_KEY, .code = KEY_A, .value = 1 },
+    };
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    events[3].input_event_usec = 2000;
+
+    replay = kzalloc(sizeof(*replay), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, replay);
+    vinput_player_init(&replay->player, vinput, vinput_replay_next);
+    KUNIT_ASSERT_EQ(test,
+                    vinput_replay_build(replay, vinput->input, events,
+                                        ARRAY_SIZE(events)),
+                    0);
+
+    /* the trailing record has no SYN_REPORT */
+    KUNIT_EXPECT_EQ(test, replay->count, 2U);
+    KUNIT_EXPECT_EQ(test, replay->offsets[0], 0ULL);
+    KUNIT_EXPECT_EQ(test, replay->offsets[1], 2000000ULL);
+
+    /* 2 ms at 2x */
+    vinput_player_start(&replay->player, 2000);
+    for (i = 0; i < 100 && READ_ONCE(replay->player.running); i++)
+        msleep(10);
+    KUNIT_EXPECT_FALSE(test, READ_ONCE(replay->player.running));
+    KUNIT_EXPECT_EQ(test, replay->player.played, 2U);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+    kunit_info(test, "replay: %llu ns late at most\n",
+               replay->player.late_max);
+
+    vinput_replay_free(replay);
+    vinput_test_destroy(vinput);
+}
+
+static void vinput_test_macro(struct kunit *test)
+{
+    int i;
+    struct vinput_macro *macro;
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+
+    /* long enough for the second trigger to queue behind the first */
+    KUNIT_ASSERT_EQ(test,
+                    vinput_macro_set(vinput, "tap", "1,30,1;0,0,20;1,30,0"), 0);
+    macro = vinput_macro_find(vinput->macros, "tap");
+    KUNIT_ASSERT_NOT_NULL(test, macro);
+    KUNIT_EXPECT_EQ(test, macro->steps, 2U);
+    KUNIT_EXPECT_EQ(test, macro->count, 2U);
+    KUNIT_EXPECT_EQ(test, macro->step[1].when, 20000000ULL);
+    KUNIT_EXPECT_EQ(test, macro->length, 20000000ULL);
+
+    /* unsupported events, negative delays and bad names are rejected */
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "bad", "1,31,1"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "bad", "0,0,-1"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "bad", "1,30"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "", "1,30,1"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "bad"), -ENOENT);
+
+    /* triggers are queued and played back to back */
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "tap"), 0);
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "tap"), 0);
+    for (i = 0; i < 100 && !READ_ONCE(vinput->macros->idle); i++)
+        msleep(10);
+    KUNIT_EXPECT_TRUE(test, READ_ONCE(vinput->macros->idle));
+    KUNIT_EXPECT_EQ(test, vinput->macros->player.played, 4U);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, vinput->input->key));
+
+    /* changing a macro drops its own triggers only */
+    KUNIT_ASSERT_EQ(test,
+                    vinput_macro_set(vinput, "hold", "1,30,1;0,0,1000;1,30,0"),
+                    0);
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "hold"), 0);
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "tap"), 0);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "tap", "1,30,1"), 0);
+    KUNIT_EXPECT_FALSE(test, READ_ONCE(vinput->macros->idle));
+    KUNIT_EXPECT_EQ(test, vinput->macros->tail - vinput->macros->head, 1U);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "hold", NULL), 0);
+    KUNIT_EXPECT_TRUE(test, READ_ONCE(vinput->macros->idle));
+
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "tap", NULL), 0);
+    KUNIT_EXPECT_EQ(test, vinput_macro_set(vinput, "tap", NULL), -ENOENT);
+    KUNIT_EXPECT_EQ(test, vinput_macro_trigger(vinput, "tap"), -ENOENT);
+
+    vinput_test_destroy(vinput);
+}
+
+/* a control file owns the device it creates until it is released */
+static void vinput_test_control(struct kunit *test)
+{
+    long id;
+    struct file file = {};
+    struct vinput *vinput;
+    struct vinput_create req = {
+        .type = "vinput-test",
+        .name = "private",
+        .vendor = 0x1234,
+        .product = -1,
+        .version = -1,
+    };
+
+    KUNIT_ASSERT_EQ(test, vinput_register(&vinput_test_dev), 0);
+
+    KUNIT_EXPECT_EQ(test, vinput_control_write(&file, NULL, 0, NULL),
+                    (ssize_t) -ENXIO);
+
+    req.mt_type = 'C';
+    KUNIT_EXPECT_EQ(test, vinput_control_create(&file, &req), -EINVAL);
+    req.mt_type = 0;
+
+    id = vinput_control_create(&file, &req);
+    KUNIT_ASSERT_GE(test, id, 0L);
+    /* neither unexport nor the mux can see it */
+    KUNIT_EXPECT_TRUE(test, IS_ERR(vinput_get_vdevice_by_id(id)));
+    vinput = ((struct vinput_file *) file.private_data)->vinput;
+    get_device(&vinput->dev);
+    KUNIT_EXPECT_TRUE(test, vinput->owned);
+    KUNIT_EXPECT_STREQ(test, vinput->input->name, "private");
+    KUNIT_EXPECT_EQ(test, vinput->input->id.vendor, 0x1234);
+    KUNIT_EXPECT_EQ(test, vinput_control_create(&file, &req), -EBUSY);
+
+    vinput_control_release(NULL, &file);
+    KUNIT_EXPECT_TRUE(test, READ_ONCE(vinput->dead));
+    KUNIT_EXPECT_TRUE(test, IS_ERR(vinput_get_vdevice_by_id(id)));
+    put_device(&vinput->dev);
+
+    vinput_unregister(&vinput_test_dev);
+}
+
+static u64 vinput_test_bytes(struct vinput *vinput)
+{
+    int cpu;
+    u64 bytes = 0;
+
+    for_each_possible_cpu (cpu)
+        bytes += per_cpu_ptr(vinput->stats, cpu)->bytes;
+
+    return bytes;
+}
+
+/* records of one write are routed per device, each frame synced apart */
+static void vinput_test_mux(struct kunit *test)
+{
+    struct vinput_mux *mux = vinput_mux_alloc();
+    struct vinput *a = vinput_test_create(&vinput_test_dev);
+    struct vinput *b = vinput_test_create(&vinput_test_dev);
+    struct vinput_mux_event rec = {
+        .event = { .type = EV_KEY, .code = KEY_A, .value = 1 },
+    };
+
+    KUNIT_ASSERT_NOT_NULL(test, mux);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+
+    rec.id = a->id;
+    KUNIT_EXPECT_EQ(test, vinput_mux_event(mux, &rec), 0);
+    rec.id = b->id;
+    KUNIT_EXPECT_EQ(test, vinput_mux_event(mux, &rec), 0);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, a->input->key));
+
+    /* a SYN_REPORT ends the frame of its own device only */
+    rec.id = a->id;
+    rec.event = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT };
+    KUNIT_EXPECT_EQ(test, vinput_mux_event(mux, &rec), 0);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, a->input->key));
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, b->input->key));
+
+    /* the end of the write syncs the frames left open, and accounts them */
+    vinput_mux_flush(mux);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, b->input->key));
+    KUNIT_EXPECT_EQ(test, vinput_test_bytes(a), (u64) (2 * sizeof(rec)));
+    KUNIT_EXPECT_EQ(test, vinput_test_bytes(b), (u64) sizeof(rec));
+
+    /* unsupported events and unknown ids are refused */
+    rec.event = (struct input_event){ .type = EV_KEY, .code = KEY_B };
+    KUNIT_EXPECT_EQ(test, vinput_mux_event(mux, &rec), -EINVAL);
+    rec.id = b->id;
+    vinput_test_destroy(b);
+    /* and gone devices are dropped from the cache */
+    vinput_mux_sweep(mux);
+    KUNIT_EXPECT_NULL(test, xa_load(&mux->files, rec.id));
+    rec.event.code = KEY_A;
+    KUNIT_EXPECT_EQ(test, vinput_mux_event(mux, &rec), -ENODEV);
+
+    vinput_mux_free(mux);
+    vinput_test_destroy(a);
+}
+
+/* a transaction emits all the frames of its devices at once, or none */
+static void vinput_test_transaction(struct kunit *test)
+{
+    struct vinput_record ra[4], rb[4];
+    struct vinput_file va = {}, vb = {};
+    struct vinput_mux *mux = vinput_mux_alloc();
+    struct vinput *a = vinput_test_create(&vinput_test_dev);
+    struct vinput *b = vinput_test_create(&vinput_test_dev);
+    struct vinput_mux_event recs[] = {
+        { .event = { .type = EV_KEY, .code = KEY_A, .value = 1 } },
+        { .event = { .type = EV_KEY, .code = KEY_B, .value = 1 } },
+        { .event = { .type = EV_SYN, .code = SYN_REPORT } },
+    };
+
+    KUNIT_ASSERT_NOT_NULL(test, mux);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(a));
+    KUNIT_ASSERT_FALSE(test, IS_ERR(b));
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(a, 4), 0);
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(b, 4), 0);
+    va.vinput = a;
+    vb.vinput = b;
+    recs[0].id = a->id;
+    recs[1].id = b->id;
+    recs[2].id = a->id;
+
+    /* the unsupported KEY_B fails the whole transaction */
+    KUNIT_EXPECT_EQ(test, vinput_mux_transaction(mux, recs, 3), -EINVAL);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_A, a->input->key));
+    KUNIT_EXPECT_EQ(test, vinput_capture_take(&va, ra, 4), 0);
+
+    /* the frame of b is left open and ended with the transaction */
+    recs[1].event.code = KEY_A;
+    KUNIT_EXPECT_EQ(test, vinput_mux_transaction(mux, recs, 3), 0);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, a->input->key));
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, b->input->key));
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(&va, ra, 4), 2);
+    KUNIT_ASSERT_EQ(test, vinput_capture_take(&vb, rb, 4), 2);
+    KUNIT_EXPECT_EQ(test, ra[0].time, rb[0].time);
+
+    vinput_mux_free(mux);
+    vinput_test_destroy(b);
+    vinput_test_destroy(a);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/* uring commands stage and read back binary records through an iov_iter */
+static void vinput_test_uring(struct kunit *test)
+{
+    struct input_event events[] = {
+        { .type = EV_KEY, .code = KEY_A, .value = 1 },
+        { .type = EV_SYN, .code = SYN_REPORT },
+    };
+    struct input_event back[4];
+    struct kvec kv = { .iov_base = events, .iov_len = sizeof(events) };
+    struct iov_iter iter;
+    struct vinput_file *vfile;
+    struct vinput *vinput = vinput_test_create(&vinput_test_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    KUNIT_ASSERT_EQ(test, vinput_capture_resize(vinput, 8), 0);
+    vfile = vinput_file_alloc(vinput);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vfile));
+
+    /* records are only taken in binary mode */
+    iov_iter_kvec(&iter, WRITE, &kv, 1, sizeof(events));
+    KUNIT_EXPECT_EQ(test, vinput_uring_inject(vfile, &iter), (ssize_t) -EINVAL);
+
+    KUNIT_ASSERT_EQ(test, vinput_set_mode(vfile, VINPUT_MODE_BINARY), 0);
+    iov_iter_kvec(&iter, WRITE, &kv, 1, sizeof(events));
+    KUNIT_EXPECT_EQ(test, vinput_uring_inject(vfile, &iter),
+                    (ssize_t) sizeof(events));
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+
+    kv = (struct kvec){ .iov_base = back, .iov_len = sizeof(back) };
+    iov_iter_kvec(&iter, READ, &kv, 1, sizeof(back));
+    KUNIT_EXPECT_EQ(test, vinput_uring_capture(vfile, &iter),
+                    (ssize_t) (2 * sizeof(back[0])));
+    KUNIT_EXPECT_EQ(test, back[0].code, KEY_A);
+    KUNIT_EXPECT_EQ(test, back[1].code, SYN_REPORT);
+
+    /* nothing left to read back */
+    iov_iter_kvec(&iter, READ, &kv, 1, sizeof(back));
+    KUNIT_EXPECT_EQ(test, vinput_uring_capture(vfile, &iter),
+                    (ssize_t) -EAGAIN);
+
+    vinput_file_free(vfile);
+    vinput_test_destroy(vinput);
+}
+#endif
+
+#if IS_REACHABLE(CONFIG_CONFIGFS_FS)
+static ssize_t vinput_test_cfg_store(struct config_item *item,
+                                     struct configfs_attribute *attr,
+                                     const char *page)
+{
+    return attr->store(item, page, strlen(page));
+}
+
+static void vinput_test_configfs(struct kunit *test)
+{
+    char *page = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+    struct vinput *vinput;
+    struct vinput_cfg *cfg;
+    struct config_item *item;
+
+    KUNIT_ASSERT_NOT_NULL(test, page);
+    KUNIT_ASSERT_EQ(test, vinput_register(&vinput_test_dev), 0);
+    item = vinput_cfg_make_item(&vinput_cfg_subsys.su_group, "pad");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(item));
+    cfg = to_vinput_cfg(item);
+
+    /* nothing to enable without a type */
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_enable,
+                                                "1"),
+                    (ssize_t) -ENODEV);
+
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_type,
+                                                "vinput-test\n"),
+                    12);
+    vinput_test_cfg_store(item, &vinput_cfg_attr_name, "test pad\n");
+    vinput_test_cfg_store(item, &vinput_cfg_attr_vendor, "0x1234");
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_product,
+                                                "65536"),
+                    (ssize_t) -ERANGE);
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_keys,
+                                                "30-32,48"),
+                    8);
+    vinput_cfg_attr_keys.show(item, page);
+    KUNIT_EXPECT_STREQ(test, page, "30-32,48\n");
+
+    /* a single write registers the whole device */
+    KUNIT_ASSERT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_enable,
+                                                "1"),
+                    1);
+    vinput = cfg->vinput;
+    KUNIT_ASSERT_NOT_NULL(test, vinput);
+    KUNIT_EXPECT_STREQ(test, vinput->input->name, "test pad");
+    KUNIT_EXPECT_EQ(test, vinput->input->id.vendor, 0x1234);
+    KUNIT_EXPECT_EQ(test, vinput->input->id.product, 0);
+    KUNIT_EXPECT_TRUE(test, device_is_registered(&vinput->input->dev));
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_name,
+                                                "other"),
+                    (ssize_t) -EBUSY);
+
+    KUNIT_EXPECT_EQ(test, vinput_test_cfg_store(item, &vinput_cfg_attr_enable,
+                                                "0"),
+                    1);
+    KUNIT_EXPECT_NULL(test, cfg->vinput);
+
+    /* removing the directory unexports an enabled device */
+    vinput_test_cfg_store(item, &vinput_cfg_attr_enable, "1");
+    KUNIT_EXPECT_NOT_NULL(test, cfg->vinput);
+    config_item_put(item);
+
+    vinput_unregister(&vinput_test_dev);
+}
+#endif
+
+static struct kunit_case vinput_test_cases[] = {
+    KUNIT_CASE(vinput_test_parse_int),
+    KUNIT_CASE(vinput_test_parse_fields),
+    KUNIT_CASE(vinput_test_parse_records),
+    KUNIT_CASE(vinput_test_parse_speed),
+    KUNIT_CASE(vinput_test_frame_queue),
+    KUNIT_CASE(vinput_test_write_text),
+    KUNIT_CASE(vinput_test_write_events),
+    KUNIT_CASE(vinput_test_capture),
+    KUNIT_CASE(vinput_test_capture_files),
+    KUNIT_CASE(vinput_test_ring),
+    KUNIT_CASE(vinput_test_replay),
+    KUNIT_CASE(vinput_test_macro),
+    KUNIT_CASE(vinput_test_control),
+    KUNIT_CASE(vinput_test_mux),
+    KUNIT_CASE(vinput_test_transaction),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    KUNIT_CASE(vinput_test_uring),
+#endif
+#if IS_REACHABLE(CONFIG_CONFIGFS_FS)
+    KUNIT_CASE(vinput_test_configfs),
+#endif
+    {},
+};
+
+static struct kunit_suite vinput_test_suite = {
+    .name = "vinput-core",
+    .test_cases = vinput_test_cases,
+};
+kunit_test_suite(vinput_test_suite);
@@ -0,0 +1,125 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vinput
+
+#if !defined(VINPUT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define VINPUT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "vinput.h"
+
+TRACE_EVENT(inject,
+
+    TP_PROTO(struct vinput *vinput,
+             unsigned int type,
+             unsigned int code,
+             int value),
+
+    TP_ARGS(vinput, type, code, value),
+
+    TP_STRUCT__entry(
+        __field(long, id)
+        __array(char, name, 16)
+        __field(unsigned int, type)
+        __field(unsigned int, code)
+        __field(int, value)
+    ),
+
+    TP_fast_assign(
+        __entry->id = vinput->id;
+        memcpy(__entry->name, vinput->type->name, 16);
+        __entry->type = type;
+        __entry->code = code;
+        __entry->value = value;
+    ),
+
+    TP_printk("vinput%ld %s type=%u code=%u value=%d", __entry->id,
+              __entry->name, __entry->type, __entry->code, __entry->value)
+);
+
+TRACE_EVENT(frame,
+
+    TP_PROTO(struct vinput *vinput, unsigned int count),
+
+    TP_ARGS(vinput, count),
+
+    TP_STRUCT__entry(
+        __field(long, id)
+        __array(char, name, 16)
+        __field(unsigned int, count)
+    ),
+
+    TP_fast_assign(
+        __entry->id = vinput->id;
+        memcpy(__entry->name, vinput->type->name, 16);
+        __entry->count = count;
+    ),
+
+    TP_printk("vinput%ld %s events=%u", __entry->id, __entry->name,
+              __entry->count)
+);
+
+TRACE_EVENT(parse_error,
+
+    TP_PROTO(struct vinput *vinput,
+             const char *buff,
+             int len,
+             int pos,
+             int err),
+
+    TP_ARGS(vinput, buff, len, pos, err),
+
+    TP_STRUCT__entry(
+        __field(long, id)
+        __array(char, name, 16)
+        __field(int, pos)
+        __field(int, err)
+        __array(char, line, 32)
+    ),
+
+    TP_fast_assign(
+        __entry->id = vinput->id;
+        memcpy(__entry->name, vinput->type->name, 16);
+        __entry->pos = pos;
+        __entry->err = err;
+        len = clamp(len, 0, 31);
+        memcpy(__entry->line, buff, len);
+        __entry->line[len] = '\0';
+    ),
+
+    TP_printk("vinput%ld %s err=%d pos=%d line=\"%s\"", __entry->id,
+              __entry->name, __entry->err, __entry->pos, __entry->line)
+);
+
+TRACE_EVENT(play,
+
+    TP_PROTO(struct vinput *vinput, u32 frame, u64 late),
+
+    TP_ARGS(vinput, frame, late),
+
+    TP_STRUCT__entry(
+        __field(long, id)
+        __array(char, name, 16)
+        __field(u32, frame)
+        __field(u64, late)
+    ),
+
+    TP_fast_assign(
+        __entry->id = vinput->id;
+        memcpy(__entry->name, vinput->type->name, 16);
+        __entry->frame = frame;
+        __entry->late = late;
+    ),
+
+    TP_printk("vinput%ld %s frame=%u late=%lluns", __entry->id,
+              __entry->name, __entry->frame, __entry->late)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vinput_trace
+
+#include <trace/define_trace.h>
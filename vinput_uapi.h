@@ -0,0 +1,184 @@
+#ifndef VINPUT_UAPI_H
+#define VINPUT_UAPI_H
+
+#include <linux/input.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Userspace interface of the /dev/vinputX nodes.
+ *
+ * A freshly opened node speaks the text protocol of its virtual device
+ * type. VINPUT_IOCTL_SET_MODE switches the open file to VINPUT_MODE_BINARY,
+ * in which each write() carries an array of struct input_event. Every record
+ * is checked against the capabilities of the input device. Records are
+ * gathered into a frame, up to VINPUT_FRAME_MAX_EVENTS of them, which an
+ * EV_SYN/SYN_REPORT record submits to the device as a whole: frames written
+ * concurrently through several files never interleave. Records left without
+ * a SYN_REPORT when the file is closed are dropped. A SYN_REPORT record with
+ * a non-zero time stamps its frame with that CLOCK_MONOTONIC time instead
+ * of the time it is emitted at.
+ *
+ * VINPUT_IOCTL_RING_SETUP allocates a single-producer ring of struct
+ * input_event for the open file, which is then mmap()ed from offset 0. The
+ * mapping starts with struct vinput_ring; the records start at its offset
+ * field. The producer fills records and publishes them by advancing head
+ * with a release store; the kernel consumes them up to head, validating
+ * them like binary writes, and advances tail. The ring is drained on
+ * VINPUT_IOCTL_RING_KICK, or continuously by a kernel thread when set up
+ * with VINPUT_RING_POLL.
+ */
+
+enum vinput_mode {
+    VINPUT_MODE_TEXT = 0,
+    VINPUT_MODE_BINARY = 1,
+};
+
+struct vinput_ring {
+    __u32 head;
+    __u32 tail;
+    __u32 entries;
+    __u32 flags;
+    __u64 offset;
+    __u64 rejected;
+};
+
+#define VINPUT_FRAME_MAX_EVENTS 256
+
+#define VINPUT_RING_POLL (1 << 0)
+#define VINPUT_RING_MAX_ENTRIES 65536
+
+struct vinput_ring_setup {
+    __u32 entries;
+    __u32 flags;
+};
+
+/*
+ * VINPUT_IOCTL_REPLAY_START hands a whole trace of count struct input_event
+ * records at events to the kernel, which emits each of its frames at the
+ * time of its SYN_REPORT record relative to the first record, scaled by
+ * speed: 500 plays at 0.5x, 1000 at 1x, 10000 at 10x and
+ * VINPUT_REPLAY_ASAP as fast as possible. The trace is validated up front
+ * and played from an hrtimer; VINPUT_IOCTL_REPLAY_STATUS reports its
+ * progress and how late its frames were emitted. With
+ * VINPUT_REPLAY_TIMESTAMP, frames are stamped with the start of the replay
+ * plus their offset in the trace, whatever the speed and lateness, instead
+ * of the time they are emitted at.
+ */
+#define VINPUT_REPLAY_ASAP 0
+#define VINPUT_REPLAY_TIMESTAMP (1 << 0)
+#define VINPUT_REPLAY_MAX_EVENTS (1 << 20)
+
+struct vinput_replay {
+    __u64 events;
+    __u32 count;
+    __u32 speed;
+    __u32 flags;
+    __u32 pad;
+};
+
+struct vinput_replay_status {
+    __u32 frames;
+    __u32 played;
+    __u32 running;
+    __u32 pad;
+    __u64 late_max_ns;
+    __u64 late_sum_ns;
+};
+
+/*
+ * Each file opened on /dev/vinput-control may create one device of its own
+ * with VINPUT_IOCTL_CREATE, of the driver named by type and described by
+ * the other fields, as a configfs item would: negative values and an empty
+ * name keep the defaults of the driver. The id of the device is returned
+ * in id. The file then stands for the /dev/vinputX node of the device, and
+ * closing it unexports the device. The device is private to the file: its
+ * node cannot be opened, and neither unexport nor the mux can reach it.
+ * mt_type must be 0, 'A' or 'B'.
+ */
+struct vinput_create {
+    char type[16];
+    char name[32];
+    __s32 vendor;
+    __s32 product;
+    __s32 version;
+    __s32 mt_type;
+    __s32 max_x;
+    __s32 max_y;
+    __s32 max_z;
+    __s32 max_points;
+    __s32 id;
+    __u32 pad;
+};
+
+/*
+ * Each record written to /dev/vinput-mux is routed to the device of the
+ * given id and staged into a frame of that device, validated like a binary
+ * write to its node. A SYN_REPORT record ends the frame of its device, and
+ * the end of each write ends the frames left open, each device with its own
+ * SYN_REPORT, so that a single write() updates any number of devices.
+ */
+struct vinput_mux_event {
+    __u32 id;
+    __u32 pad;
+    struct input_event event;
+};
+
+/*
+ * VINPUT_IOCTL_TRANSACTION on a /dev/vinput-mux file takes count struct
+ * vinput_mux_event records at events, split into frames like a write, but
+ * emits them all or none: every record is validated first, then the frames
+ * are emitted back to back, in order, with a single timestamp and without
+ * any frame of another writer to these devices in between.
+ */
+#define VINPUT_TRANSACTION_MAX_EVENTS 4096
+
+struct vinput_transaction {
+    __u64 events;
+    __u32 count;
+    __u32 flags;
+};
+
+/*
+ * On kernels from 5.19, IORING_OP_URING_CMD submissions to a /dev/vinputX
+ * node, or to a control file once its device is created, carry a struct
+ * vinput_uring_cmd in the command area of the SQE, naming a buffer of len
+ * bytes at addr, or at the offset addr of a registered buffer when the SQE
+ * has IORING_URING_CMD_FIXED (from 6.0). VINPUT_URING_CMD_INJECT stages the
+ * struct input_event records of the buffer like a binary write, on a file
+ * in binary mode; VINPUT_URING_CMD_CAPTURE fills it with the pending
+ * capture records as struct input_event, completing with -EAGAIN when
+ * there is none. Both complete with the number of bytes consumed.
+ * VINPUT_URING_CMD_CREATE, on a control file, takes a struct
+ * vinput_create like VINPUT_IOCTL_CREATE and completes with the id.
+ */
+struct vinput_uring_cmd {
+    __u64 addr;
+    __u32 len;
+    __u32 pad;
+};
+
+#define VINPUT_IOCTL_BASE 'v'
+
+#define VINPUT_IOCTL_SET_MODE _IOW(VINPUT_IOCTL_BASE, 1, int)
+#define VINPUT_IOCTL_GET_MODE _IOR(VINPUT_IOCTL_BASE, 2, int)
+#define VINPUT_IOCTL_RING_SETUP \
+    _IOW(VINPUT_IOCTL_BASE, 3, struct vinput_ring_setup)
+#define VINPUT_IOCTL_RING_KICK _IO(VINPUT_IOCTL_BASE, 4)
+#define VINPUT_IOCTL_REPLAY_START \
+    _IOW(VINPUT_IOCTL_BASE, 5, struct vinput_replay)
+#define VINPUT_IOCTL_REPLAY_STOP _IO(VINPUT_IOCTL_BASE, 6)
+#define VINPUT_IOCTL_REPLAY_STATUS \
+    _IOR(VINPUT_IOCTL_BASE, 7, struct vinput_replay_status)
+#define VINPUT_IOCTL_CREATE _IOWR(VINPUT_IOCTL_BASE, 8, struct vinput_create)
+#define VINPUT_IOCTL_TRANSACTION \
+    _IOW(VINPUT_IOCTL_BASE, 9, struct vinput_transaction)
+
+#define VINPUT_URING_CMD_INJECT \
+    _IOW(VINPUT_IOCTL_BASE, 16, struct vinput_uring_cmd)
+#define VINPUT_URING_CMD_CAPTURE \
+    _IOR(VINPUT_IOCTL_BASE, 17, struct vinput_uring_cmd)
+#define VINPUT_URING_CMD_CREATE \
+    _IOWR(VINPUT_IOCTL_BASE, 18, struct vinput_uring_cmd)
+
+#endif
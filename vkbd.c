@@ -1,31 +1,434 @@
+#include <linux/device.h>
 #include <linux/init.h>
 #include <linux/input.h>
+#include <linux/kfifo.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/xarray.h>
 
 #include "vinput.h"
+#include "vinput_parse.h"
 
 #define VINPUT_KBD "vkbd"
 #define VINPUT_RELEASE 0
 #define VINPUT_PRESS 1
 
+/* modifiers of a layout entry */
+#define VKBD_SHIFT 0x1
+#define VKBD_ALTGR 0x2
+
+/* characters waiting to be typed */
+#define VKBD_TEXT_SIZE 4096
+
 static unsigned short vkeymap[KEY_MAX];
 
+/*
+ * Text typing: a command starting with '"' is UTF-8 text. Its characters
+ * are mapped to a keycode and modifiers by the layout of the device, an
+ * xarray indexed by code point, and typed by a player as a press frame and
+ * a release frame each, at rate characters per second, or as fast as
+ * possible when rate is 0.
+ */
+struct vkbd_data {
+    struct xarray layout;
+
+    spinlock_t lock;
+    DECLARE_KFIFO_PTR(text, u32);
+    struct vinput_player player;
+    bool idle;
+    bool release;
+    u64 when;
+    unsigned int rate;
+};
+
+/* US QWERTY layout loaded into every new device */
+static const char *const vkbd_rows[] = {
+    "1234567890",
+    "qwertyuiop",
+    "asdfghjkl",
+    "zxcvbnm",
+};
+static const char *const vkbd_shift_rows[] = {
+    "!@#$%^&*()",
+    "QWERTYUIOP",
+    "ASDFGHJKL",
+    "ZXCVBNM",
+};
+static const unsigned short vkbd_row_keys[] = {KEY_1, KEY_Q, KEY_A, KEY_Z};
+
+static const struct {
+    char c;
+    unsigned short key;
+    u8 mods;
+} vkbd_us_keys[] = {
+    {' ', KEY_SPACE},
+    {'\n', KEY_ENTER},
+    {'\t', KEY_TAB},
+    {'\b', KEY_BACKSPACE},
+    {'-', KEY_MINUS},
+    {'_', KEY_MINUS, VKBD_SHIFT},
+    {'=', KEY_EQUAL},
+    {'+', KEY_EQUAL, VKBD_SHIFT},
+    {'[', KEY_LEFTBRACE},
+    {'{', KEY_LEFTBRACE, VKBD_SHIFT},
+    {']', KEY_RIGHTBRACE},
+    {'}', KEY_RIGHTBRACE, VKBD_SHIFT},
+    {'\\', KEY_BACKSLASH},
+    {'|', KEY_BACKSLASH, VKBD_SHIFT},
+    {';', KEY_SEMICOLON},
+    {':', KEY_SEMICOLON, VKBD_SHIFT},
+    {'\'', KEY_APOSTROPHE},
+    {'"', KEY_APOSTROPHE, VKBD_SHIFT},
+    {'`', KEY_GRAVE},
+    {'~', KEY_GRAVE, VKBD_SHIFT},
+    {',', KEY_COMMA},
+    {'<', KEY_COMMA, VKBD_SHIFT},
+    {'.', KEY_DOT},
+    {'>', KEY_DOT, VKBD_SHIFT},
+    {'/', KEY_SLASH},
+    {'?', KEY_SLASH, VKBD_SHIFT},
+};
+
+static int vkbd_layout_set(struct vkbd_data *kbd,
+                           u32 cp,
+                           unsigned int key,
+                           unsigned int mods)
+{
+    return xa_err(xa_store(&kbd->layout, cp, xa_mk_value(key | mods << 16),
+                           GFP_KERNEL));
+}
+
+static int vkbd_layout_reset(struct vkbd_data *kbd)
+{
+    int i, j;
+    int err = 0;
+
+    xa_destroy(&kbd->layout);
+
+    for (i = 0; i < ARRAY_SIZE(vkbd_rows); i++) {
+        for (j = 0; vkbd_rows[i][j]; j++) {
+            err |= vkbd_layout_set(kbd, vkbd_rows[i][j], vkbd_row_keys[i] + j,
+                                   0);
+            err |= vkbd_layout_set(kbd, vkbd_shift_rows[i][j],
+                                   vkbd_row_keys[i] + j, VKBD_SHIFT);
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(vkbd_us_keys); i++)
+        err |= vkbd_layout_set(kbd, vkbd_us_keys[i].c, vkbd_us_keys[i].key,
+                               vkbd_us_keys[i].mods);
+
+    return err ? -ENOMEM : 0;
+}
+
+/* Produce the next press or release frame of the text being typed */
+static struct vinput_frame *vkbd_type_next(struct vinput_player *player,
+                                           u64 *when)
+{
+    u32 cp;
+    int value;
+    unsigned int key, mods;
+    unsigned int rate;
+    void *entry;
+    struct vinput_frame *frame = NULL;
+    struct vkbd_data *kbd = container_of(player, struct vkbd_data, player);
+
+    spin_lock(&kbd->lock);
+    while (kfifo_peek(&kbd->text, &cp)) {
+        /* the layout may have changed since the text was queued */
+        entry = xa_load(&kbd->layout, cp);
+        if (!entry) {
+            kfifo_skip(&kbd->text);
+            kbd->release = false;
+            continue;
+        }
+
+        frame = vinput_frame_alloc(3, GFP_ATOMIC);
+        if (!frame)
+            break;
+
+        key = xa_to_value(entry) & 0xffff;
+        mods = xa_to_value(entry) >> 16;
+        value = kbd->release ? VINPUT_RELEASE : VINPUT_PRESS;
+
+        /* modifiers go down before the key and up after it */
+        if (kbd->release)
+            vinput_frame_add(frame, EV_KEY, key, value);
+        if (mods & VKBD_SHIFT)
+            vinput_frame_add(frame, EV_KEY, KEY_LEFTSHIFT, value);
+        if (mods & VKBD_ALTGR)
+            vinput_frame_add(frame, EV_KEY, KEY_RIGHTALT, value);
+        if (!kbd->release)
+            vinput_frame_add(frame, EV_KEY, key, value);
+
+        rate = READ_ONCE(kbd->rate);
+        *when = kbd->when;
+        kbd->when += rate ? NSEC_PER_SEC / rate / 2 : 0;
+        if (kbd->release)
+            kfifo_skip(&kbd->text);
+        kbd->release = !kbd->release;
+        break;
+    }
+    if (!frame)
+        kbd->idle = true;
+    spin_unlock(&kbd->lock);
+
+    return frame;
+}
+
+/* Decode the UTF-8 character at s, returns its length */
+static int vkbd_utf8(const char *s, int len, u32 *cp)
+{
+    int i, n;
+    u8 c = s[0];
+
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+
+    if ((c & 0xe0) == 0xc0) {
+        n = 2;
+        *cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+        n = 3;
+        *cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+        n = 4;
+        *cp = c & 0x07;
+    } else {
+        return -EILSEQ;
+    }
+
+    if (len < n)
+        return -EILSEQ;
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return -EILSEQ;
+        *cp = *cp << 6 | (s[i] & 0x3f);
+    }
+
+    return n;
+}
+
+/* Decode the character at pos, an escape or UTF-8, returns its length */
+static int vkbd_char(const char *buff, int len, int pos, u32 *cp)
+{
+    if (buff[pos] != '\\' || pos + 1 >= len)
+        return vkbd_utf8(buff + pos, len - pos, cp);
+
+    switch (buff[pos + 1]) {
+    case 'n':
+        *cp = '\n';
+        break;
+    case 't':
+        *cp = '\t';
+        break;
+    case 'b':
+        *cp = '\b';
+        break;
+    case '\\':
+        *cp = '\\';
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return 2;
+}
+
+/*
+ * Queue the text following the '"' of a command, with \n, \t, \b and \\
+ * escapes. A command is queued whole or not at all: it is checked and
+ * counted first, then decoded again into the fifo.
+ */
+static int vkbd_type(struct vinput *vinput, const char *buff, int len)
+{
+    int n = 0;
+    int ret;
+    int pos;
+    bool start;
+    u32 cp;
+    struct vkbd_data *kbd = vinput->priv_data;
+
+    for (pos = 1; pos < len; pos += ret, n++) {
+        ret = vkbd_char(buff, len, pos, &cp);
+        if (ret > 0 && !xa_load(&kbd->layout, cp))
+            ret = -ENOENT;
+        if (ret < 0) {
+            vinput_parse_error(vinput, buff, len, pos, ret);
+            dev_warn_ratelimited(&vinput->dev,
+                                 "Cannot type character at %d\n", pos);
+            return ret == -ENOENT ? -EINVAL : ret;
+        }
+    }
+
+    spin_lock_bh(&kbd->lock);
+    if (kfifo_avail(&kbd->text) < n) {
+        spin_unlock_bh(&kbd->lock);
+        return -EAGAIN;
+    }
+    for (pos = 1; pos < len; pos += ret) {
+        ret = vkbd_char(buff, len, pos, &cp);
+        kfifo_put(&kbd->text, cp);
+    }
+    start = kbd->idle && n;
+    if (start) {
+        kbd->idle = false;
+        kbd->when = 0;
+    }
+    spin_unlock_bh(&kbd->lock);
+
+    if (start)
+        vinput_player_start(&kbd->player, 1000);
+
+    return len;
+}
+
+static ssize_t layout_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    unsigned long cp;
+    unsigned int n = 0;
+    void *entry;
+    struct vkbd_data *kbd = dev_to_vinput(dev)->priv_data;
+
+    xa_for_each (&kbd->layout, cp, entry)
+        n++;
+
+    return sysfs_emit(buf, "%u\n", n);
+}
+
+/*
+ * Each line maps a code point, in hex, to a keycode and modifiers:
+ * "e9 18 2" types U+00E9 with AltGr and KEY_E. "reset" loads the US layout.
+ */
+static ssize_t layout_store(struct device *dev,
+                            struct device_attribute *attr,
+                            const char *buf,
+                            size_t size)
+{
+    int err = 0;
+    u32 cp;
+    unsigned int key;
+    unsigned int mods;
+    char *copy, *pos, *line;
+    struct vkbd_data *kbd = dev_to_vinput(dev)->priv_data;
+
+    copy = kstrndup(buf, size, GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+
+    pos = copy;
+    while (!err && (line = strsep(&pos, "\n"))) {
+        if (!*line)
+            continue;
+        if (!strcmp(line, "reset")) {
+            err = vkbd_layout_reset(kbd);
+            continue;
+        }
+
+        mods = 0;
+        if (sscanf(line, "%x %u %u", &cp, &key, &mods) < 2 ||
+            key >= KEY_MAX || mods & ~(VKBD_SHIFT | VKBD_ALTGR))
+            err = -EINVAL;
+        else
+            err = vkbd_layout_set(kbd, cp, key, mods);
+    }
+    kfree(copy);
+
+    return err ? err : size;
+}
+
+static ssize_t rate_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    struct vkbd_data *kbd = dev_to_vinput(dev)->priv_data;
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(kbd->rate));
+}
+
+static ssize_t rate_store(struct device *dev,
+                          struct device_attribute *attr,
+                          const char *buf,
+                          size_t size)
+{
+    int err;
+    unsigned int rate;
+    struct vkbd_data *kbd = dev_to_vinput(dev)->priv_data;
+
+    err = kstrtouint(buf, 10, &rate);
+    if (err)
+        return err;
+    WRITE_ONCE(kbd->rate, rate);
+
+    return size;
+}
+
+static struct device_attribute vkbd_attrs[] = {
+    __ATTR(layout, S_IWUSR | S_IRUGO, layout_show, layout_store),
+    __ATTR(rate, S_IWUSR | S_IRUGO, rate_show, rate_store),
+    __ATTR_NULL,
+};
+
 static int vinput_vkbd_init(struct vinput *vinput)
 {
-    int i;
+    int err;
+    struct vkbd_data *kbd;
+    struct device_attribute *attr = vkbd_attrs;
 
     vinput->input->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_REP);
     vinput->input->keycodesize = sizeof(unsigned short);
     vinput->input->keycodemax = KEY_MAX;
     vinput->input->keycode = vkeymap;
 
-    for (i = 0; i < KEY_MAX; i++)
-        set_bit(vkeymap[i], vinput->input->keybit);
+    /* vkeymap is the identity map, so every keycode below KEY_MAX is set */
+    if (vinput->config && !bitmap_empty(vinput->config->keys, KEY_CNT))
+        bitmap_copy(vinput->input->keybit, vinput->config->keys, KEY_CNT);
+    else
+        bitmap_fill(vinput->input->keybit, KEY_MAX);
+
+    kbd = kzalloc(sizeof(struct vkbd_data), GFP_KERNEL);
+    if (!kbd)
+        return -ENOMEM;
+    vinput->priv_data = kbd;
+
+    xa_init(&kbd->layout);
+    spin_lock_init(&kbd->lock);
+    kbd->idle = true;
+    vinput_player_init(&kbd->player, vinput, vkbd_type_next);
+    err = kfifo_alloc(&kbd->text, VKBD_TEXT_SIZE, GFP_KERNEL);
+    if (!err)
+        err = vkbd_layout_reset(kbd);
+    if (err)
+        return err;
+
+    while (attr->attr.name)
+        device_create_file(&vinput->dev, attr++);
 
     return input_register_device(vinput->input);
 }
 
+static int vinput_vkbd_kill(struct vinput *vinput)
+{
+    struct vkbd_data *kbd = vinput->priv_data;
+    struct device_attribute *attr = vkbd_attrs;
+
+    if (!kbd)
+        return 0;
+
+    while (attr->attr.name)
+        device_remove_file(&vinput->dev, attr++);
+    vinput_player_stop(&kbd->player);
+    kfifo_free(&kbd->text);
+    xa_destroy(&kbd->layout);
+    kfree(kbd);
+
+    return 0;
+}
+
 static int vinput_vkbd_read(struct vinput *vinput, char *buff, int len)
 {
     spin_lock(&vinput->lock);
@@ -37,36 +440,49 @@ static int vinput_vkbd_read(struct vinput *vinput, char *buff, int len)
 
 static int vinput_vkbd_send(struct vinput *vinput, char *buff, int len)
 {
-    int ret;
-    long key = 0;
+    int key;
     short type = VINPUT_PRESS;
+    struct vinput_parser p;
+    struct vinput_frame *frame;
+
+    if (buff[0] == '"')
+        return vkbd_type(vinput, buff, len);
+
+    vinput_parser_init(&p, buff, len);
+    if (vinput_parse_int(&p, &key) || vinput_parse_end(&p)) {
+        vinput_parser_error(vinput, &p);
+        dev_warn_ratelimited(&vinput->dev, "Invalid input format: [+-]key\n");
+        return p.err;
+    }
+    /* checked before negating, as -INT_MIN overflows */
+    if (key < -KEY_MAX || key > KEY_MAX) {
+        vinput_parse_error(vinput, buff, len, 0, -EINVAL);
+        dev_warn_ratelimited(&vinput->dev, "Keycode out of range: %d\n", key);
+        return -EINVAL;
+    }
+
+    frame = vinput_frame_alloc(1, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
 
-    if (buff[0] == '+')
-        ret = kstrtol(buff + 1, 10, &key);
-    else
-        ret = kstrtol(buff, 10, &key);
-    if (ret)
-        dev_err(&vinput->dev, "error during kstrtol: -%d\n", ret);
     spin_lock(&vinput->lock);
     vinput->last_entry = key;
-    spin_unlock(&vinput->lock);
-
     if (key < 0) {
         type = VINPUT_RELEASE;
         key = -key;
     }
+    vinput_frame_add(frame, EV_KEY, key, type);
+    vinput_frame_queue(vinput, frame);
+    spin_unlock(&vinput->lock);
 
-    dev_info(&vinput->dev, "Event %s code %ld\n",
-             (type == VINPUT_RELEASE) ? "VINPUT_RELEASE" : "VINPUT_PRESS", key);
-
-    input_report_key(vinput->input, key, type);
-    input_sync(vinput->input);
+    vinput_frame_flush(vinput);
 
     return len;
 }
 
 static struct vinput_ops vkbd_ops = {
     .init = vinput_vkbd_init,
+    .kill = vinput_vkbd_kill,
     .send = vinput_vkbd_send,
     .read = vinput_vkbd_read,
 };
@@ -96,3 +512,7 @@ module_exit(vkbd_end);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tristan Lelong <tristan.lelong@blunderer.org>");
 MODULE_DESCRIPTION("Emulate keyboard input events through /dev/vinput");
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+#include "vkbd_test.c"
+#endif
@@ -0,0 +1,186 @@
+/*
+ * KUnit tests for vkbd, included at the end of vkbd.c when
+ * CONFIG_VINPUT_KUNIT_TEST is enabled.
+ */
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+
+#define VKBD_TEST_LOOPS 100000
+
+static int vkbd_send_str(struct vinput *vinput, const char *cmd)
+{
+    char buff[VINPUT_MAX_LEN + 1];
+
+    strscpy(buff, cmd, sizeof(buff));
+    return vinput_vkbd_send(vinput, buff, strlen(buff));
+}
+
+static void vkbd_test_press_release(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "+34"), 3);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_G, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, vinput->last_entry, 34L);
+
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "-34"), 3);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_G, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, vinput->last_entry, -34L);
+
+    /* no sign is a press */
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "30"), 2);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_A, vinput->input->key));
+    vkbd_send_str(vinput, "-30");
+}
+
+static void vkbd_test_boundaries(struct kunit *test)
+{
+    char cmd[16];
+    struct vinput *vinput = test->priv;
+
+    snprintf(cmd, sizeof(cmd), "+%d", KEY_MAX - 1);
+    vkbd_send_str(vinput, cmd);
+    KUNIT_EXPECT_TRUE(test, test_bit(KEY_MAX - 1, vinput->input->key));
+    cmd[0] = '-';
+    vkbd_send_str(vinput, cmd);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_MAX - 1, vinput->input->key));
+
+    /* out of range keycodes are rejected before reaching the input core */
+    snprintf(cmd, sizeof(cmd), "+%d", KEY_MAX + 1);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, cmd), -EINVAL);
+    snprintf(cmd, sizeof(cmd), "-%d", KEY_MAX + 1);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, cmd), -EINVAL);
+    snprintf(cmd, sizeof(cmd), "%d", INT_MIN);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, cmd), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vinput->last_entry, (long) -(KEY_MAX - 1));
+}
+
+static void vkbd_test_malformed(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+
+    vkbd_send_str(vinput, "-30");
+
+    /* unparsable commands are rejected and inject nothing */
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "abc"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "+"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "12x"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "+-12"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "99999999999"), -ERANGE);
+    KUNIT_EXPECT_EQ(test, vinput->last_entry, -30L);
+    KUNIT_EXPECT_FALSE(test, test_bit(KEY_RESERVED, vinput->input->key));
+}
+
+static void vkbd_test_utf8(struct kunit *test)
+{
+    u32 cp;
+
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("a", 1, &cp), 1);
+    KUNIT_EXPECT_EQ(test, cp, (u32) 'a');
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xc3\xa9", 2, &cp), 2);
+    KUNIT_EXPECT_EQ(test, cp, (u32) 0xe9);
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xe2\x82\xac", 3, &cp), 3);
+    KUNIT_EXPECT_EQ(test, cp, (u32) 0x20ac);
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xf0\x9f\x98\x80", 4, &cp), 4);
+    KUNIT_EXPECT_EQ(test, cp, (u32) 0x1f600);
+
+    /* truncated, stray continuation and invalid lead bytes */
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xc3", 1, &cp), -EILSEQ);
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xa9", 1, &cp), -EILSEQ);
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xc3a", 2, &cp), -EILSEQ);
+    KUNIT_EXPECT_EQ(test, vkbd_utf8("\xff", 1, &cp), -EILSEQ);
+}
+
+static void vkbd_test_layout(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+    struct vkbd_data *kbd = vinput->priv_data;
+
+    KUNIT_EXPECT_EQ(test, xa_to_value(xa_load(&kbd->layout, 'q')),
+                    (unsigned long) KEY_Q);
+    KUNIT_EXPECT_EQ(test, xa_to_value(xa_load(&kbd->layout, 'M')),
+                    (unsigned long) (KEY_M | VKBD_SHIFT << 16));
+    KUNIT_EXPECT_EQ(test, xa_to_value(xa_load(&kbd->layout, ')')),
+                    (unsigned long) (KEY_0 | VKBD_SHIFT << 16));
+    KUNIT_EXPECT_EQ(test, xa_to_value(xa_load(&kbd->layout, '\n')),
+                    (unsigned long) KEY_ENTER);
+    KUNIT_EXPECT_FALSE(test, xa_load(&kbd->layout, 0xe9));
+
+    /* characters missing from the layout reject the whole command */
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "\"caf\xc3\xa9"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "\"a\\q"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "\"a\xc3"), -EILSEQ);
+    KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&kbd->text));
+
+    KUNIT_EXPECT_EQ(test, vkbd_layout_set(kbd, 0xe9, KEY_E, VKBD_ALTGR), 0);
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "\"caf\xc3\xa9"), 6);
+}
+
+static void vkbd_test_type(struct kunit *test)
+{
+    int i;
+    struct vinput *vinput = test->priv;
+    struct vkbd_data *kbd = vinput->priv_data;
+
+    KUNIT_EXPECT_EQ(test, vkbd_send_str(vinput, "\"Hello, World!\\n"), 16);
+
+    for (i = 0; i < 100 && !READ_ONCE(kbd->idle); i++)
+        msleep(10);
+    KUNIT_EXPECT_TRUE(test, READ_ONCE(kbd->idle));
+    KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&kbd->text));
+    KUNIT_EXPECT_EQ(test, kbd->player.played, 2U * 14);
+
+    /* every key, modifiers included, went up again */
+    KUNIT_EXPECT_TRUE(test, bitmap_empty(vinput->input->key, KEY_CNT));
+}
+
+static void vkbd_test_throughput(struct kunit *test)
+{
+    int i;
+    u64 start, elapsed;
+    struct vinput *vinput = test->priv;
+
+    start = ktime_get_ns();
+    for (i = 0; i < VKBD_TEST_LOOPS; i++)
+        vkbd_send_str(vinput, i & 1 ? "-30" : "+30");
+    elapsed = ktime_get_ns() - start;
+
+    kunit_info(test, "vkbd: %llu ns per command\n",
+               div_u64(elapsed, VKBD_TEST_LOOPS));
+}
+
+static int vkbd_test_init(struct kunit *test)
+{
+    struct vinput *vinput = vinput_test_create(&vkbd_dev);
+
+    if (IS_ERR(vinput))
+        return PTR_ERR(vinput);
+    test->priv = vinput;
+
+    return 0;
+}
+
+static void vkbd_test_exit(struct kunit *test)
+{
+    vinput_test_destroy(test->priv);
+}
+
+static struct kunit_case vkbd_test_cases[] = {
+    KUNIT_CASE(vkbd_test_press_release),
+    KUNIT_CASE(vkbd_test_boundaries),
+    KUNIT_CASE(vkbd_test_malformed),
+    KUNIT_CASE(vkbd_test_utf8),
+    KUNIT_CASE(vkbd_test_layout),
+    KUNIT_CASE(vkbd_test_type),
+    KUNIT_CASE(vkbd_test_throughput),
+    {},
+};
+
+static struct kunit_suite vkbd_test_suite = {
+    .name = "vinput-vkbd",
+    .init = vkbd_test_init,
+    .exit = vkbd_test_exit,
+    .test_cases = vkbd_test_cases,
+};
+kunit_test_suite(vkbd_test_suite);
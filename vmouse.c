@@ -8,6 +8,7 @@
 #include <linux/spinlock.h>
 
 #include "vinput.h"
+#include "vinput_parse.h"
 
 #define VINPUT_MOUSE "vmouse"
 
@@ -15,15 +16,22 @@ static int vinput_vmouse_init(struct vinput *vinput)
 {
     int *buttons = kmalloc(sizeof(int), GFP_KERNEL);
 
+    if (!buttons)
+        return -ENOMEM;
+
     __set_bit(EV_REL, vinput->input->evbit);
     __set_bit(REL_X, vinput->input->relbit);
     __set_bit(REL_Y, vinput->input->relbit);
     __set_bit(REL_WHEEL, vinput->input->relbit);
 
     __set_bit(EV_KEY, vinput->input->evbit);
-    __set_bit(BTN_LEFT, vinput->input->keybit);
-    __set_bit(BTN_RIGHT, vinput->input->keybit);
-    __set_bit(BTN_MIDDLE, vinput->input->keybit);
+    if (vinput->config && !bitmap_empty(vinput->config->keys, KEY_CNT)) {
+        bitmap_copy(vinput->input->keybit, vinput->config->keys, KEY_CNT);
+    } else {
+        __set_bit(BTN_LEFT, vinput->input->keybit);
+        __set_bit(BTN_RIGHT, vinput->input->keybit);
+        __set_bit(BTN_MIDDLE, vinput->input->keybit);
+    }
 
     *buttons = 0;
     vinput->priv_data = buttons;
@@ -38,8 +46,15 @@ static int vinput_vmouse_kill(struct vinput *vinput)
     return 0;
 }
 
+/* motion is relative, so only the button state reads back */
 static int vinput_vmouse_read(struct vinput *vinput, char *buff, int len)
 {
+    int *state = vinput->priv_data;
+
+    spin_lock(&vinput->lock);
+    len = snprintf(buff, len, "0,0,0,%d\n", *state);
+    spin_unlock(&vinput->lock);
+
     return len;
 }
 
@@ -49,36 +64,53 @@ static int vinput_vmouse_read(struct vinput *vinput, char *buff, int len)
 
 static int vinput_vmouse_send(struct vinput *vinput, char *buff, int len)
 {
-    int ret;
+    int v[4];
     int x, y, wheel;
     int buttons;
     int *state = vinput->priv_data;
-
-    ret = sscanf(buff, "%d,%d,%d,%d", &x, &y, &wheel, &buttons);
-    if (ret != 4) {
-        dev_warn(&vinput->dev, "Invalid input format: x,y,wheel,buttons\n");
-        return -EINVAL;
+    struct vinput_parser p;
+    struct vinput_frame *frame;
+
+    vinput_parser_init(&p, buff, len);
+    if (vinput_parse_fields(&p, v, 4) || vinput_parse_end(&p)) {
+        vinput_parser_error(vinput, &p);
+        dev_warn_ratelimited(&vinput->dev,
+                             "Invalid input format: x,y,wheel,buttons\n");
+        return p.err;
     }
+    x = v[0];
+    y = v[1];
+    wheel = v[2];
+    buttons = v[3];
+
+    frame = vinput_frame_alloc(4, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+
     if (x)
-        input_report_rel(vinput->input, REL_X, x);
+        vinput_frame_add(frame, EV_REL, REL_X, x);
     if (y)
-        input_report_rel(vinput->input, REL_Y, y);
+        vinput_frame_add(frame, EV_REL, REL_Y, y);
     if (wheel)
-        input_report_rel(vinput->input, REL_WHEEL, wheel);
+        vinput_frame_add(frame, EV_REL, REL_WHEEL, wheel);
 
+    /* the button state is shared by the writers of the device */
+    spin_lock(&vinput->lock);
     if ((*state | buttons) & (0x1 << VBUTTON_LEFT))
-        input_report_key(vinput->input, BTN_LEFT,
+        vinput_frame_add(frame, EV_KEY, BTN_LEFT,
                          1 & (buttons >> VBUTTON_LEFT));
     else if ((*state | buttons) & (0x1 << VBUTTON_RIGHT))
-        input_report_key(vinput->input, BTN_RIGHT,
+        vinput_frame_add(frame, EV_KEY, BTN_RIGHT,
                          1 & (buttons >> VBUTTON_RIGHT));
     else if ((*state | buttons) & (0x1 << VBUTTON_MIDDLE))
-        input_report_key(vinput->input, BTN_MIDDLE,
+        vinput_frame_add(frame, EV_KEY, BTN_MIDDLE,
                          1 & (buttons >> VBUTTON_MIDDLE));
 
     *state = buttons;
+    vinput_frame_queue(vinput, frame);
+    spin_unlock(&vinput->lock);
 
-    input_sync(vinput->input);
+    vinput_frame_flush(vinput);
 
     return len;
 }
@@ -111,3 +143,7 @@ module_exit(vmouse_end);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tristan Lelong <tristan.lelong@blunderer.org>");
 MODULE_DESCRIPTION("Emulate mouse input events through /dev/vinput");
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+#include "vmouse_test.c"
+#endif
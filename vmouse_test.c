@@ -0,0 +1,103 @@
+/*
+ * KUnit tests for vmouse, included at the end of vmouse.c when
+ * CONFIG_VINPUT_KUNIT_TEST is enabled.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define VMOUSE_TEST_LOOPS 100000
+
+static int vmouse_send_str(struct vinput *vinput, const char *cmd)
+{
+    char buff[VINPUT_MAX_LEN + 1];
+
+    strscpy(buff, cmd, sizeof(buff));
+    return vinput_vmouse_send(vinput, buff, strlen(buff));
+}
+
+static void vmouse_test_motion(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, "1,2,3,0"), 7);
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, "-10,-20,-1,0"), 12);
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, "0,0,0,0"), 7);
+}
+
+static void vmouse_test_buttons(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+    int *state = vinput->priv_data;
+
+    vmouse_send_str(vinput, "0,0,0,1");
+    KUNIT_EXPECT_TRUE(test, test_bit(BTN_LEFT, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, *state, 1);
+
+    vmouse_send_str(vinput, "0,0,0,0");
+    KUNIT_EXPECT_FALSE(test, test_bit(BTN_LEFT, vinput->input->key));
+    KUNIT_EXPECT_EQ(test, *state, 0);
+
+    vmouse_send_str(vinput, "0,0,0,2");
+    KUNIT_EXPECT_TRUE(test, test_bit(BTN_RIGHT, vinput->input->key));
+    vmouse_send_str(vinput, "0,0,0,0");
+    KUNIT_EXPECT_FALSE(test, test_bit(BTN_RIGHT, vinput->input->key));
+}
+
+static void vmouse_test_malformed(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+    int *state = vinput->priv_data;
+
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, "1,2,3"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, "a,b,c,d"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vmouse_send_str(vinput, ""), -EINVAL);
+    /* a rejected command leaves the button state alone */
+    KUNIT_EXPECT_EQ(test, *state, 0);
+}
+
+static void vmouse_test_throughput(struct kunit *test)
+{
+    int i;
+    u64 start, elapsed;
+    struct vinput *vinput = test->priv;
+
+    start = ktime_get_ns();
+    for (i = 0; i < VMOUSE_TEST_LOOPS; i++)
+        vmouse_send_str(vinput, "5,-5,0,0");
+    elapsed = ktime_get_ns() - start;
+
+    kunit_info(test, "vmouse: %llu ns per command\n",
+               div_u64(elapsed, VMOUSE_TEST_LOOPS));
+}
+
+static int vmouse_test_init(struct kunit *test)
+{
+    struct vinput *vinput = vinput_test_create(&vmouse_dev);
+
+    if (IS_ERR(vinput))
+        return PTR_ERR(vinput);
+    test->priv = vinput;
+
+    return 0;
+}
+
+static void vmouse_test_exit(struct kunit *test)
+{
+    vinput_test_destroy(test->priv);
+}
+
+static struct kunit_case vmouse_test_cases[] = {
+    KUNIT_CASE(vmouse_test_motion),
+    KUNIT_CASE(vmouse_test_buttons),
+    KUNIT_CASE(vmouse_test_malformed),
+    KUNIT_CASE(vmouse_test_throughput),
+    {},
+};
+
+static struct kunit_suite vmouse_test_suite = {
+    .name = "vinput-vmouse",
+    .init = vmouse_test_init,
+    .exit = vmouse_test_exit,
+    .test_cases = vmouse_test_cases,
+};
+kunit_test_suite(vmouse_test_suite);
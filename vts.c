@@ -1,14 +1,33 @@
+#include <linux/ctype.h>
 #include <linux/device.h>
+#include <linux/fixp-arith.h>
+#include <linux/hash.h>
 #include <linux/input.h>
 #include <linux/input/mt.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 
 #include "vinput.h"
+#include "vinput_parse.h"
 
 #define VINPUT_TS "vts"
 #define VTS_CALIB_DONE 0x001f
+/* events reported per updated slot, at most */
+#define VTS_SLOT_EVENTS 6
+
+/* gesture frames per second, by default */
+#define VTS_GESTURE_RATE 120
+#define VTS_GESTURE_MAX_RATE 10000
+#define VTS_GESTURE_MAX_MS 60000
+#define VTS_GESTURE_MAX_TURNS 16
+#define VTS_GESTURE_FINGERS 10
+/* tracking ids of the gesture fingers */
+#define VTS_GESTURE_ID 0xff00
+/* gesture progress in 1/65536, and angles in 1/64 degree */
+#define VTS_ONE (1 << 16)
+#define VTS_DEG 64
 
 enum vts_init_flags {
     calib_type,
@@ -24,16 +43,40 @@ enum vts_attributes {
     attr_max_y,
     attr_max_z,
     attr_max_points,
+    attr_rate,
 };
 
 static struct device_attribute vts_attrs[];
 
 struct mtslot {
-    int updated;
     int id;
     int x;
     int y;
     int z;
+    /* in the id map while the slot holds a type B contact */
+    struct hlist_node node;
+};
+
+/*
+ * A gesture moves its fingers from progress 0 to 1 in steps frames, one
+ * every period ns, then lifts them in a last frame. Linear gestures move
+ * the first finger from (x0,y0) to (x1,y1), the others following at
+ * (dx,dy) from each other. Circular ones spread the fingers evenly on a
+ * circle around (x0,y0), its radius going from r0 to r1 and its rotation
+ * from a0 to a1.
+ */
+struct vts_gesture {
+    bool circular;
+    bool ease;
+    int fingers;
+    int x0, y0, x1, y1;
+    int dx, dy;
+    int r0, r1, a0, a1;
+    unsigned int step;
+    unsigned int steps;
+    u64 period;
+    /* slots held by the fingers, type B only */
+    int slots[VTS_GESTURE_FINGERS];
 };
 
 struct vts_data {
@@ -47,11 +90,36 @@ struct vts_data {
     int max_points;
 
     struct mtslot *slots;
+    /* type B slots by tracking id, and the slots holding no contact */
+    struct hlist_head *ids;
+    unsigned int id_bits;
+    unsigned long *free;
+    /* slots updated since the last frame */
+    unsigned long *dirty;
+
+    /* gesture being played, under vinput->lock */
+    struct vinput_player player;
+    struct vts_gesture gesture;
+    bool gesturing;
+    unsigned int rate;
 };
 
-static void vinput_vts_register_final(struct device *dev)
+static void vts_free_slots(struct vts_data *drvdata)
+{
+    kfree(drvdata->slots);
+    kfree(drvdata->ids);
+    bitmap_free(drvdata->free);
+    bitmap_free(drvdata->dirty);
+    drvdata->slots = NULL;
+    drvdata->ids = NULL;
+    drvdata->free = NULL;
+    drvdata->dirty = NULL;
+}
+
+static int vinput_vts_register_final(struct device *dev)
 {
     int i;
+    int err;
     struct vinput *vinput = dev_to_vinput(dev);
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
 
@@ -66,22 +134,41 @@ static void vinput_vts_register_final(struct device *dev)
     input_set_abs_params(vinput->input, ABS_MT_PRESSURE, 0, drvdata->max_z, 0,
                          0);
 
+    /* twice as many buckets as slots keeps the id chains short */
+    drvdata->id_bits = ilog2(roundup_pow_of_two(drvdata->max_points)) + 1;
     drvdata->slots =
-        kzalloc(sizeof(struct mtslot) * drvdata->max_points, GFP_KERNEL);
+        kcalloc(drvdata->max_points, sizeof(struct mtslot), GFP_KERNEL);
+    drvdata->ids =
+        kcalloc(1 << drvdata->id_bits, sizeof(struct hlist_head), GFP_KERNEL);
+    drvdata->free = bitmap_zalloc(drvdata->max_points, GFP_KERNEL);
+    drvdata->dirty = bitmap_zalloc(drvdata->max_points, GFP_KERNEL);
+    if (!drvdata->slots || !drvdata->ids || !drvdata->free ||
+        !drvdata->dirty) {
+        dev_err(&vinput->dev, "cannot allocate %d slots\n",
+                drvdata->max_points);
+        vts_free_slots(drvdata);
+        return -ENOMEM;
+    }
+
     for (i = 0; i < drvdata->max_points; i++)
         drvdata->slots[i].id = -1;
+    bitmap_fill(drvdata->free, drvdata->max_points);
 
     if (drvdata->type == TYPE_B)
         input_mt_init_slots(vinput->input, drvdata->max_points, 0);
 
-    if (input_register_device(vinput->input))
+    err = input_register_device(vinput->input);
+    if (err) {
         dev_err(&vinput->dev, "cannot register vinput input device\n");
+        vts_free_slots(drvdata);
+        return err;
+    }
     drvdata->registered = 1;
 
-    return;
+    return 0;
 }
 
-static void vinput_vts_calib_done(struct device *dev, int flag)
+static int vinput_vts_calib_done(struct device *dev, int flag)
 {
     struct vinput *vinput = dev_to_vinput(dev);
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
@@ -89,7 +176,9 @@ static void vinput_vts_calib_done(struct device *dev, int flag)
     drvdata->init_flag |= (1 << flag);
 
     if ((drvdata->init_flag & VTS_CALIB_DONE) == VTS_CALIB_DONE)
-        vinput_vts_register_final(dev);
+        return vinput_vts_register_final(dev);
+
+    return 0;
 }
 
 static ssize_t type_show(struct device *dev,
@@ -112,6 +201,7 @@ static ssize_t type_store(struct device *dev,
                           const char *buf,
                           size_t size)
 {
+    int status;
     struct vinput *vinput = dev_to_vinput(dev);
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
 
@@ -128,9 +218,9 @@ static ssize_t type_store(struct device *dev,
     else
         return -EPROTONOSUPPORT;
 
-    vinput_vts_calib_done(dev, calib_type);
+    status = vinput_vts_calib_done(dev, calib_type);
 
-    return size;
+    return status ? status : size;
 };
 
 static ssize_t calib_show(struct device *dev,
@@ -198,26 +288,87 @@ static ssize_t calib_store(struct device *dev,
         drvdata->max_z = val;
         flag = calib_z;
     } else if (attr == &vts_attrs[attr_max_points]) {
+        if (val <= 0 || val > VINPUT_MAX_POINTS)
+            return -EINVAL;
         drvdata->max_points = val;
         flag = calib_points;
     } else {
         return -EPROTO;
     }
 
-    vinput_vts_calib_done(dev, flag);
+    status = vinput_vts_calib_done(dev, flag);
 
-    return size;
+    return status ? status : size;
 };
 
+static ssize_t rate_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    struct vinput *vinput = dev_to_vinput(dev);
+    struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
+
+    return sprintf(buf, "%u\n", READ_ONCE(drvdata->rate));
+}
+
+/* Frame rate of the gestures started from now on */
+static ssize_t rate_store(struct device *dev,
+                          struct device_attribute *attr,
+                          const char *buf,
+                          size_t size)
+{
+    int status;
+    unsigned int rate;
+    struct vinput *vinput = dev_to_vinput(dev);
+    struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
+
+    status = kstrtouint(buf, 10, &rate);
+    if (status < 0)
+        return status;
+    if (!rate || rate > VTS_GESTURE_MAX_RATE)
+        return -EINVAL;
+
+    WRITE_ONCE(drvdata->rate, rate);
+
+    return size;
+}
+
 static struct device_attribute vts_attrs[] = {
     __ATTR(type, S_IWUSR | S_IRUGO, type_show, type_store),
     __ATTR(max_x, S_IWUSR | S_IRUGO, calib_show, calib_store),
     __ATTR(max_y, S_IWUSR | S_IRUGO, calib_show, calib_store),
     __ATTR(max_z, S_IWUSR | S_IRUGO, calib_show, calib_store),
     __ATTR(max_points, S_IWUSR | S_IRUGO, calib_show, calib_store),
+    __ATTR(rate, S_IWUSR | S_IRUGO, rate_show, rate_store),
     __ATTR_NULL,
 };
 
+static struct vinput_frame *vts_gesture_next(struct vinput_player *player,
+                                             u64 *when);
+
+static int vts_configure(struct vts_data *drvdata,
+                         const struct vinput_config *config)
+{
+    if (config->mt_type == 'A')
+        drvdata->type = TYPE_A;
+    else if (config->mt_type == 'B')
+        drvdata->type = TYPE_B;
+    else
+        return -EINVAL;
+
+    if (config->max_x < 0 || config->max_y < 0 || config->max_z < 0 ||
+        config->max_points <= 0 || config->max_points > VINPUT_MAX_POINTS)
+        return -EINVAL;
+
+    drvdata->max_x = config->max_x;
+    drvdata->max_y = config->max_y;
+    drvdata->max_z = config->max_z;
+    drvdata->max_points = config->max_points;
+    drvdata->init_flag = VTS_CALIB_DONE;
+
+    return 0;
+}
+
 static int vinput_vts_init(struct vinput *vinput)
 {
     int err = 0;
@@ -225,6 +376,8 @@ static int vinput_vts_init(struct vinput *vinput)
     struct device_attribute *attr = vts_attrs;
 
     drvdata = kmalloc(sizeof(struct vts_data), GFP_KERNEL);
+    if (!drvdata)
+        return -ENOMEM;
     vinput->priv_data = drvdata;
 
     drvdata->registered = 0;
@@ -232,8 +385,15 @@ static int vinput_vts_init(struct vinput *vinput)
     drvdata->type = TYPE_NONE;
     drvdata->max_x = -1;
     drvdata->max_y = -1;
+    drvdata->max_z = -1;
     drvdata->max_points = -1;
     drvdata->slots = NULL;
+    drvdata->ids = NULL;
+    drvdata->free = NULL;
+    drvdata->dirty = NULL;
+    drvdata->gesturing = false;
+    drvdata->rate = VTS_GESTURE_RATE;
+    vinput_player_init(&drvdata->player, vinput, vts_gesture_next);
 
     __set_bit(EV_ABS, vinput->input->evbit);
     __set_bit(EV_KEY, vinput->input->evbit);
@@ -245,6 +405,13 @@ static int vinput_vts_init(struct vinput *vinput)
         device_create_file(&vinput->dev, attr++);
     }
 
+    /* a configfs device comes calibrated and is registered at once */
+    if (vinput->config) {
+        err = vts_configure(drvdata, vinput->config);
+        if (!err)
+            err = vinput_vts_register_final(&vinput->dev);
+    }
+
     return err;
 }
 
@@ -253,9 +420,13 @@ static int vinput_vts_kill(struct vinput *vinput)
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
     struct device_attribute *attr = vts_attrs;
 
+    if (!drvdata)
+        return 0;
+
     while (attr->attr.name)
         device_remove_file(&vinput->dev, attr++);
-    kfree(drvdata->slots);
+    vinput_player_stop(&drvdata->player);
+    vts_free_slots(drvdata);
     kfree(drvdata);
 
     return 0;
@@ -267,116 +438,445 @@ static int vinput_vts_read(struct vinput *vinput, char *buff, int len)
 
     if (!drvdata->registered)
         return -EINVAL;
-    return len;
+
+    /* no readback, emitted frames are recorded by the capture ring */
+    return 0;
+}
+
+/* Give a free type B slot to the tracking id */
+static void vts_slot_claim(struct vts_data *drvdata, int slot_id, int id)
+{
+    struct mtslot *slot = &drvdata->slots[slot_id];
+
+    slot->id = id;
+    __clear_bit(slot_id, drvdata->free);
+    hlist_add_head(&slot->node,
+                   &drvdata->ids[hash_32((u32) id, drvdata->id_bits)]);
 }
 
+static void vts_slot_release(struct vts_data *drvdata, int slot_id)
+{
+    struct mtslot *slot = &drvdata->slots[slot_id];
+
+    slot->id = -1;
+    __set_bit(slot_id, drvdata->free);
+    hlist_del_init(&slot->node);
+}
+
+/*
+ * Type A contacts take the first slot not updated yet in the frame, type B
+ * ones the slot of their tracking id, or else the first free slot.
+ */
 static int vinput_vts_find_slot(struct vts_data *drvdata, int id)
 {
-    int i;
+    unsigned int i;
+    struct mtslot *slot;
 
-    for (i = 0; i < drvdata->max_points; i++) {
-        if (drvdata->type == TYPE_A && drvdata->slots[i].updated)
-            continue;
-        else if (drvdata->type == TYPE_A)
-            break;
-        else if (drvdata->slots[i].id == id)
-            break;
+    if (drvdata->type == TYPE_A) {
+        i = find_first_zero_bit(drvdata->dirty, drvdata->max_points);
+    } else {
+        hlist_for_each_entry (slot,
+                              &drvdata->ids[hash_32((u32) id,
+                                                    drvdata->id_bits)],
+                              node) {
+            if (slot->id == id)
+                return slot - drvdata->slots;
+        }
+        i = find_first_bit(drvdata->free, drvdata->max_points);
     }
 
-    if ((drvdata->type == TYPE_B) && (i == drvdata->max_points))
-        for (i = 0; i < drvdata->max_points; i++)
-            if (drvdata->slots[i].id == -1)
-                break;
+    return i >= drvdata->max_points ? -1 : i;
+}
 
-    return (i == drvdata->max_points) ? -1 : i;
+/* Update a contact, zero pressure lifting it and freeing its slot */
+static void vinput_vts_set_slot(struct vts_data *drvdata,
+                                int slot_id,
+                                int id,
+                                int x,
+                                int y,
+                                int z)
+{
+    struct mtslot *slot = &drvdata->slots[slot_id];
+
+    if (drvdata->type == TYPE_A)
+        slot->id = z == 0 ? -1 : id;
+    else if (z == 0 && slot->id != -1)
+        vts_slot_release(drvdata, slot_id);
+    else if (z != 0 && slot->id == -1)
+        vts_slot_claim(drvdata, slot_id, id);
+    slot->x = x;
+    slot->y = y;
+    slot->z = z;
+    __set_bit(slot_id, drvdata->dirty);
+}
+
+/* Frame for the updates of n contacts */
+static struct vinput_frame *vts_frame_alloc(struct vts_data *drvdata,
+                                            int n,
+                                            gfp_t gfp)
+{
+    struct vinput_frame *frame;
+
+    frame = vinput_frame_alloc(min(n, drvdata->max_points) * VTS_SLOT_EVENTS,
+                               gfp);
+    if (!frame)
+        return NULL;
+
+    frame->flags = VINPUT_FRAME_MT_POINTER;
+    if (drvdata->type == TYPE_B)
+        frame->flags |= VINPUT_FRAME_MT_SYNC;
+
+    return frame;
+}
+
+/* Add the updated slots to frame and clear their update */
+static void vinput_vts_fill(struct vts_data *drvdata,
+                            struct vinput_frame *frame)
+{
+    unsigned int i;
+    struct mtslot *slot;
+
+    for_each_set_bit (i, drvdata->dirty, drvdata->max_points) {
+        slot = &drvdata->slots[i];
+        if (drvdata->type == TYPE_B) {
+            vinput_frame_add(frame, EV_ABS, ABS_MT_SLOT, i);
+            vinput_frame_add(frame, EV_ABS, ABS_MT_TRACKING_ID, slot->id);
+            vinput_frame_add(frame, EV_ABS, ABS_MT_TOOL_TYPE, MT_TOOL_FINGER);
+        }
+
+        vinput_frame_add(frame, EV_ABS, ABS_MT_POSITION_X, slot->x);
+        vinput_frame_add(frame, EV_ABS, ABS_MT_POSITION_Y, slot->y);
+        if (slot->z > 0)
+            vinput_frame_add(frame, EV_ABS, ABS_MT_PRESSURE, slot->z);
+        else if (slot->z < 0)
+            vinput_frame_add(frame, EV_ABS, ABS_MT_DISTANCE, -slot->z);
+
+        if (drvdata->type == TYPE_A)
+            vinput_frame_add(frame, EV_SYN, SYN_MT_REPORT, 0);
+        __clear_bit(i, drvdata->dirty);
+    }
 }
 
 static int vinput_vts_parse(struct vinput *vinput, char *buff, int len)
 {
-    char *slot;
+    int v[4];
     int slot_id;
     int id, x, y, z;
+    struct vinput_parser p;
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
 
-    while ((slot = strsep(&buff, ";"))) {
-        int ret = sscanf(slot, "%d,%d,%d,%d", &id, &x, &y, &z);
-        if (ret != 4) {
-            dev_warn(&vinput->dev, "Invalid input format\n");
-            len = -EINVAL;
+    vinput_parser_init(&p, buff, len);
+    do {
+        if (vinput_parse_fields(&p, v, 4))
             break;
-        }
-        slot_id = vinput_vts_find_slot(drvdata, id);
-        pr_info("slot=%d\n", slot_id);
+        id = v[0];
+        x = v[1];
+        y = v[2];
+        z = v[3];
 
+        slot_id = vinput_vts_find_slot(drvdata, id);
         if (slot_id < 0) {
-            dev_warn(&vinput->dev, "No available slots. Max=%d\n",
-                     drvdata->max_points);
-            len = -EINVAL;
-            break;
+            vinput_parser_fail(&p, -ENOSPC);
+            vinput_parser_error(vinput, &p);
+            dev_warn_ratelimited(&vinput->dev, "No available slots. Max=%d\n",
+                                 drvdata->max_points);
+            return -EINVAL;
         }
 
-        if (z == 0)
-            drvdata->slots[slot_id].id = -1;
-        else
-            drvdata->slots[slot_id].id = id;
-        drvdata->slots[slot_id].x = x;
-        drvdata->slots[slot_id].y = y;
-        drvdata->slots[slot_id].z = z;
-        drvdata->slots[slot_id].updated = 1;
-        pr_info("NEW TOUCH EVT[%d]: id=%d (%d,%d,%d)\n", slot_id,
-                drvdata->slots[slot_id].id, x, y, z);
+        vinput_vts_set_slot(drvdata, slot_id, id, x, y, z);
+    } while (vinput_parse_next(&p));
+
+    if (vinput_parse_end(&p)) {
+        vinput_parser_error(vinput, &p);
+        dev_warn_ratelimited(&vinput->dev, "Invalid input format\n");
+        return -EINVAL;
     }
 
     return len;
 }
 
+/* in s64, as the endpoints of a gesture are only clamped once reached */
+static s64 vts_lerp(s64 a, s64 b, u32 t)
+{
+    return a + (((b - a) * t) >> 16);
+}
+
+/* Position of finger i of a gesture at progress t */
+static void vts_gesture_point(struct vts_data *drvdata,
+                              struct vts_gesture *g,
+                              int i,
+                              u32 t,
+                              int *x,
+                              int *y)
+{
+    int a;
+    s64 r, px, py;
+    const int turn = 360 * VTS_DEG;
+
+    /* smoothstep, 3t^2 - 2t^3 */
+    if (g->ease)
+        t = (u64) t * t * (3 * VTS_ONE - 2 * t) >> 32;
+
+    if (g->circular) {
+        r = vts_lerp(g->r0, g->r1, t);
+        a = (int) vts_lerp(g->a0, g->a1, t) + i * turn / g->fingers;
+        a = (a % turn + turn) % turn;
+        px = g->x0 + ((r * fixp_cos32_rad(a, turn)) >> 31);
+        py = g->y0 + ((r * fixp_sin32_rad(a, turn)) >> 31);
+    } else {
+        px = vts_lerp(g->x0, g->x1, t) + (s64) i * g->dx;
+        py = vts_lerp(g->y0, g->y1, t) + (s64) i * g->dy;
+    }
+
+    *x = clamp_t(s64, px, 0, drvdata->max_x);
+    *y = clamp_t(s64, py, 0, drvdata->max_y);
+}
+
+/*
+ * Produce the next frame of the gesture. The fingers keep their type B
+ * slots across the lift frame, and only free them on the following call,
+ * once that frame was queued, so that no contact can reuse a slot before
+ * its lift is emitted.
+ */
+static struct vinput_frame *vts_gesture_next(struct vinput_player *player,
+                                             u64 *when)
+{
+    int i, slot_id;
+    int x, y, z;
+    u32 t;
+    struct vinput_frame *frame;
+    struct vts_data *drvdata = container_of(player, struct vts_data, player);
+    struct vts_gesture *g = &drvdata->gesture;
+    struct vinput *vinput = player->vinput;
+
+    frame = vts_frame_alloc(drvdata, g->fingers, GFP_ATOMIC);
+
+    spin_lock(&vinput->lock);
+    if (!frame || g->step > g->steps + 1) {
+        if (drvdata->type == TYPE_B)
+            for (i = 0; i < g->fingers; i++)
+                vts_slot_release(drvdata, g->slots[i]);
+        drvdata->gesturing = false;
+        spin_unlock(&vinput->lock);
+        kfree(frame);
+        return NULL;
+    }
+
+    t = div_u64((u64) min(g->step, g->steps) * VTS_ONE, g->steps);
+    z = g->step > g->steps ? 0 : max(drvdata->max_z / 2, 1);
+    for (i = 0; i < g->fingers; i++) {
+        slot_id = drvdata->type == TYPE_B ? g->slots[i] :
+                                            vinput_vts_find_slot(drvdata, 0);
+        vts_gesture_point(drvdata, g, i, t, &x, &y);
+        vinput_vts_set_slot(drvdata, slot_id, VTS_GESTURE_ID + i, x, y, z);
+    }
+    vinput_vts_fill(drvdata, frame);
+
+    /* keep the slots until the lift is queued */
+    if (!z && drvdata->type == TYPE_B)
+        for (i = 0; i < g->fingers; i++)
+            vts_slot_claim(drvdata, g->slots[i], VTS_GESTURE_ID + i);
+
+    *when = g->step++ * g->period;
+    spin_unlock(&vinput->lock);
+
+    return frame;
+}
+
+/* Consume word at the cursor, if it is there */
+static bool vts_parse_word(struct vinput_parser *p, const char *word)
+{
+    size_t n = strlen(word);
+
+    if (p->err || (size_t) (p->end - p->pos) < n || memcmp(p->pos, word, n))
+        return false;
+    p->pos += n;
+
+    return true;
+}
+
+/*
+ * Parse one of
+ *   swipe <fingers> <x0>,<y0> <x1>,<y1> <ms>ms [linear|ease]
+ *   pinch <fingers> <x>,<y> <r0> <r1> <ms>ms [linear|ease]
+ *   rotate <fingers> <x>,<y> <r> <degrees> <ms>ms [linear|ease]
+ *   press <x>,<y> <ms>ms
+ */
+static int vts_gesture_parse(struct vinput *vinput,
+                             char *buff,
+                             int len,
+                             struct vts_gesture *g,
+                             int *ms)
+{
+    int v[4];
+    struct vinput_parser p;
+    struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
+
+    memset(g, 0, sizeof(*g));
+    g->fingers = 1;
+
+    vinput_parser_init(&p, buff, len);
+    if (vts_parse_word(&p, "swipe ")) {
+        vinput_parse_int(&p, &g->fingers);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_fields(&p, v, 2);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_fields(&p, v + 2, 2);
+        g->x0 = v[0];
+        g->y0 = v[1];
+        g->x1 = v[2];
+        g->y1 = v[3];
+    } else if (vts_parse_word(&p, "pinch ")) {
+        g->circular = true;
+        vinput_parse_int(&p, &g->fingers);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_fields(&p, v, 2);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_int(&p, &g->r0);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_int(&p, &g->r1);
+        g->x0 = v[0];
+        g->y0 = v[1];
+    } else if (vts_parse_word(&p, "rotate ")) {
+        g->circular = true;
+        vinput_parse_int(&p, &g->fingers);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_fields(&p, v, 2);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_int(&p, &g->r0);
+        vinput_parse_sep(&p, ' ');
+        vinput_parse_int(&p, &v[2]);
+        if (!p.err && abs(v[2]) > VTS_GESTURE_MAX_TURNS * 360)
+            vinput_parser_fail(&p, -ERANGE);
+        g->x0 = v[0];
+        g->y0 = v[1];
+        g->r1 = g->r0;
+        g->a1 = v[2] * VTS_DEG;
+    } else if (vts_parse_word(&p, "press ")) {
+        vinput_parse_fields(&p, v, 2);
+        g->x0 = g->x1 = v[0];
+        g->y0 = g->y1 = v[1];
+    } else {
+        vinput_parser_fail(&p, -EINVAL);
+    }
+
+    vinput_parse_sep(&p, ' ');
+    vinput_parse_int(&p, ms);
+    if (!p.err && !vts_parse_word(&p, "ms"))
+        vinput_parser_fail(&p, -EINVAL);
+    if (!vts_parse_word(&p, " ease"))
+        vts_parse_word(&p, " linear");
+    else
+        g->ease = true;
+
+    if (!p.err && (g->fingers < 1 || g->fingers > VTS_GESTURE_FINGERS ||
+                   g->fingers > drvdata->max_points || *ms < 0 ||
+                   *ms > VTS_GESTURE_MAX_MS ||
+                   g->r0 < 0 || g->r1 < 0))
+        vinput_parser_fail(&p, -EINVAL);
+
+    if (vinput_parse_end(&p)) {
+        vinput_parser_error(vinput, &p);
+        dev_warn_ratelimited(&vinput->dev, "Invalid gesture\n");
+        return p.err;
+    }
+
+    /* spread the fingers of a swipe across its direction */
+    if (abs((s64) g->x1 - g->x0) >= abs((s64) g->y1 - g->y0))
+        g->dy = drvdata->max_y / 16;
+    else
+        g->dx = drvdata->max_x / 16;
+
+    return 0;
+}
+
+/* Play a gesture command, one at a time per device */
+static int vts_gesture(struct vinput *vinput, char *buff, int len)
+{
+    int i, ms;
+    int slot_id;
+    int err;
+    struct vts_gesture g;
+    struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
+
+    err = vts_gesture_parse(vinput, buff, len, &g, &ms);
+    if (err)
+        return err;
+
+    g.period = div_u64(NSEC_PER_SEC, READ_ONCE(drvdata->rate));
+    g.steps = max_t(u32, div_u64((u64) ms * NSEC_PER_MSEC, g.period), 1);
+
+    spin_lock_bh(&vinput->lock);
+    if (drvdata->gesturing) {
+        spin_unlock_bh(&vinput->lock);
+        return -EBUSY;
+    }
+
+    /* reserve the type B slots of the fingers for the whole gesture */
+    for (i = 0; drvdata->type == TYPE_B && i < g.fingers; i++) {
+        slot_id = vinput_vts_find_slot(drvdata, VTS_GESTURE_ID + i);
+        if (slot_id < 0 || drvdata->slots[slot_id].id != -1) {
+            while (i--)
+                vts_slot_release(drvdata, g.slots[i]);
+            spin_unlock_bh(&vinput->lock);
+            dev_warn_ratelimited(&vinput->dev, "No available slots. Max=%d\n",
+                                 drvdata->max_points);
+            return -ENOSPC;
+        }
+        vts_slot_claim(drvdata, slot_id, VTS_GESTURE_ID + i);
+        g.slots[i] = slot_id;
+    }
+
+    drvdata->gesture = g;
+    drvdata->gesturing = true;
+    spin_unlock_bh(&vinput->lock);
+
+    vinput_player_start(&drvdata->player, 1000);
+
+    return len;
+}
+
 static int vinput_vts_send(struct vinput *vinput, char *buff, int len)
 {
-    int i;
     int ret;
+    int n = 1;
+    char *p;
+    struct vinput_frame *frame;
     struct vts_data *drvdata = (struct vts_data *) vinput->priv_data;
 
     if (!drvdata->registered)
         return -EINVAL;
 
-    /* parse slots */
+    if (isalpha(buff[0]))
+        return vts_gesture(vinput, buff, len);
+
+    /* one contact per record */
+    for (p = buff; (p = memchr(p, ';', buff + len - p)); p++)
+        n++;
+
+    frame = vts_frame_alloc(drvdata, n, GFP_KERNEL);
+    if (!frame)
+        return -ENOMEM;
+
+    /* the slots are shared by the writers of the device and its gestures */
+    spin_lock_bh(&vinput->lock);
+
+    /*
+     * Contacts parsed before an invalid record are updated all the same,
+     * and emitted so that clients follow the slots.
+     */
     ret = vinput_vts_parse(vinput, buff, len);
-    if (ret < 0)
-        return ret;
-
-    /* process slots */
-    for (i = 0; i < drvdata->max_points; i++) {
-        if (drvdata->slots[i].updated) {
-            if (drvdata->type == TYPE_B) {
-                input_mt_slot(vinput->input, i);
-                input_report_abs(vinput->input, ABS_MT_TRACKING_ID,
-                                 drvdata->slots[i].id);
-                input_report_abs(vinput->input, ABS_MT_TOOL_TYPE,
-                                 MT_TOOL_FINGER);
-            }
-
-            input_report_abs(vinput->input, ABS_MT_POSITION_X,
-                             drvdata->slots[i].x);
-            input_report_abs(vinput->input, ABS_MT_POSITION_Y,
-                             drvdata->slots[i].y);
-            if (drvdata->slots[i].z > 0)
-                input_report_abs(vinput->input, ABS_MT_PRESSURE,
-                                 drvdata->slots[i].z);
-            else if (drvdata->slots[i].z < 0)
-                input_report_abs(vinput->input, ABS_MT_DISTANCE,
-                                 -drvdata->slots[i].z);
-
-            if (drvdata->type == TYPE_A)
-                input_mt_sync(vinput->input);
-            drvdata->slots[i].updated = 0;
-            pr_info("SEND TOUCH EVT[%d]: id=%d\n", i, drvdata->slots[i].id);
-        }
-    }
+    vinput_vts_fill(drvdata, frame);
 
-    input_mt_report_pointer_emulation(vinput->input, true);
-    input_sync(vinput->input);
+    if (frame->count)
+        vinput_frame_queue(vinput, frame);
+    else
+        kfree(frame);
+    spin_unlock_bh(&vinput->lock);
 
-    return len;
+    vinput_frame_flush(vinput);
+
+    return ret;
 }
 
 static struct vinput_ops vts_ops = {
@@ -407,3 +907,7 @@ module_exit(vts_end);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jean-Baptiste Theou <jbtheou@gmail.com>");
 MODULE_DESCRIPTION("Emulate multitouch input events through /dev/vinput");
+
+#if IS_ENABLED(CONFIG_VINPUT_KUNIT_TEST)
+#include "vts_test.c"
+#endif
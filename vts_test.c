@@ -0,0 +1,292 @@
+/*
+ * KUnit tests for vts, included at the end of vts.c when
+ * CONFIG_VINPUT_KUNIT_TEST is enabled.
+ */
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+
+#define VTS_TEST_LOOPS 100000
+#define VTS_TEST_POINTS 4
+
+static int vts_send_str(struct vinput *vinput, const char *cmd)
+{
+    char buff[VINPUT_MAX_LEN + 1];
+
+    /* vinput_vts_parse() splits the buffer in place */
+    strscpy(buff, cmd, sizeof(buff));
+    return vinput_vts_send(vinput, buff, strlen(buff));
+}
+
+static int vts_slot_value(struct vinput *vinput, int slot, int code)
+{
+    return input_mt_get_value(&vinput->input->mt->slots[slot], code);
+}
+
+static void vts_test_contact(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+    struct vts_data *drvdata = vinput->priv_data;
+
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "7,100,200,50"), 12);
+    KUNIT_EXPECT_EQ(test, drvdata->slots[0].id, 7);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_POSITION_X), 100);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_POSITION_Y), 200);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_PRESSURE), 50);
+
+    /* the same id keeps its slot */
+    vts_send_str(vinput, "7,110,210,50");
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_POSITION_X), 110);
+
+    /* zero pressure lifts the contact and frees the slot */
+    vts_send_str(vinput, "7,110,210,0");
+    KUNIT_EXPECT_EQ(test, drvdata->slots[0].id, -1);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_TRACKING_ID), -1);
+}
+
+static void vts_test_multi_contact(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+    struct vts_data *drvdata = vinput->priv_data;
+
+    vts_send_str(vinput, "1,10,10,5;2,20,20,5;3,30,30,5");
+    KUNIT_EXPECT_EQ(test, drvdata->slots[0].id, 1);
+    KUNIT_EXPECT_EQ(test, drvdata->slots[1].id, 2);
+    KUNIT_EXPECT_EQ(test, drvdata->slots[2].id, 3);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 2, ABS_MT_POSITION_X), 30);
+
+    /* a freed slot is reused by the next new contact */
+    vts_send_str(vinput, "2,20,20,0");
+    vts_send_str(vinput, "9,90,90,5");
+    KUNIT_EXPECT_EQ(test, drvdata->slots[1].id, 9);
+}
+
+static void vts_test_slot_map(struct kunit *test)
+{
+    struct vinput_frame *frame;
+    struct vinput *vinput = test->priv;
+    struct vts_data *drvdata = vinput->priv_data;
+
+    vts_send_str(vinput, "10,1,1,1;20,2,2,1;30,3,3,1;40,4,4,1");
+    KUNIT_EXPECT_TRUE(test, bitmap_empty(drvdata->free, VTS_TEST_POINTS));
+    KUNIT_EXPECT_TRUE(test, bitmap_empty(drvdata->dirty, VTS_TEST_POINTS));
+    KUNIT_EXPECT_EQ(test, vinput_vts_find_slot(drvdata, 30), 2);
+    KUNIT_EXPECT_EQ(test, vinput_vts_find_slot(drvdata, 50), -1);
+
+    /* a lift frees the slot and drops the id from the map */
+    vts_send_str(vinput, "20,2,2,0");
+    KUNIT_EXPECT_TRUE(test, test_bit(1, drvdata->free));
+    KUNIT_EXPECT_EQ(test, vinput_vts_find_slot(drvdata, 20), 1);
+    KUNIT_EXPECT_EQ(test, vinput_vts_find_slot(drvdata, 50), 1);
+
+    /* only the updated slot is emitted */
+    frame = vts_frame_alloc(drvdata, VTS_TEST_POINTS, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, frame);
+    vinput_vts_set_slot(drvdata, 3, 40, 5, 5, 1);
+    vinput_vts_fill(drvdata, frame);
+    KUNIT_EXPECT_EQ(test, frame->count, 6U);
+    KUNIT_EXPECT_EQ(test, frame->events[0].value, 3);
+    KUNIT_EXPECT_TRUE(test, frame->flags & VINPUT_FRAME_MT_SYNC);
+    KUNIT_EXPECT_TRUE(test, bitmap_empty(drvdata->dirty, VTS_TEST_POINTS));
+    kfree(frame);
+}
+
+static void vts_test_overflow(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+
+    vts_send_str(vinput, "1,1,1,1;2,2,2,1;3,3,3,1;4,4,4,1");
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "5,5,5,1"), -EINVAL);
+}
+
+static void vts_test_malformed(struct kunit *test)
+{
+    struct vinput *vinput = test->priv;
+
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "1,2,3"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "x,y,z,w"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "1,1,1,1;"), -EINVAL);
+}
+
+static void vts_test_unregistered(struct kunit *test)
+{
+    struct vinput *vinput = vinput_test_create(&vts_dev);
+
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "1,1,1,1"), -EINVAL);
+    vinput_test_destroy(vinput);
+}
+
+static void vts_test_gesture_parse(struct kunit *test)
+{
+    int ms;
+    int x, y;
+    char cmd[VINPUT_MAX_LEN + 1];
+    struct vts_gesture g;
+    struct vinput *vinput = test->priv;
+    struct vts_data *drvdata = vinput->priv_data;
+
+    strscpy(cmd, "pinch 2 500,500 100 300 50ms ease", sizeof(cmd));
+    KUNIT_ASSERT_EQ(test, vts_gesture_parse(vinput, cmd, strlen(cmd), &g, &ms),
+                    0);
+    KUNIT_EXPECT_TRUE(test, g.circular);
+    KUNIT_EXPECT_TRUE(test, g.ease);
+    KUNIT_EXPECT_EQ(test, g.fingers, 2);
+    KUNIT_EXPECT_EQ(test, g.r1, 300);
+    KUNIT_EXPECT_EQ(test, ms, 50);
+
+    /* fingers spread evenly on the circle, to within the sine table */
+    vts_gesture_point(drvdata, &g, 0, 0, &x, &y);
+    KUNIT_EXPECT_LE(test, abs(x - 600) + abs(y - 500), 2);
+    vts_gesture_point(drvdata, &g, 1, VTS_ONE, &x, &y);
+    KUNIT_EXPECT_LE(test, abs(x - 200) + abs(y - 500), 2);
+
+    strscpy(cmd, "swipe 2 100,100 900,100 300ms", sizeof(cmd));
+    KUNIT_ASSERT_EQ(test, vts_gesture_parse(vinput, cmd, strlen(cmd), &g, &ms),
+                    0);
+    vts_gesture_point(drvdata, &g, 1, VTS_ONE / 2, &x, &y);
+    KUNIT_EXPECT_EQ(test, x, 500);
+    KUNIT_EXPECT_EQ(test, y, 100 + 1023 / 16);
+
+    /* far endpoints interpolate without overflow, clamped to the screen */
+    strscpy(cmd, "swipe 1 -2000000000,0 2000000000,0 300ms", sizeof(cmd));
+    KUNIT_ASSERT_EQ(test, vts_gesture_parse(vinput, cmd, strlen(cmd), &g, &ms),
+                    0);
+    vts_gesture_point(drvdata, &g, 0, VTS_ONE / 4, &x, &y);
+    KUNIT_EXPECT_EQ(test, x, 0);
+    vts_gesture_point(drvdata, &g, 0, VTS_ONE * 3 / 4, &x, &y);
+    KUNIT_EXPECT_EQ(test, x, drvdata->max_x);
+
+    /* more fingers than slots, unknown gestures and missing units */
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "swipe 5 1,1 2,2 10ms"),
+                    -EINVAL);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "wave 1 1,1 10ms"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "press 1,1 10"), -EINVAL);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "press 1,1 10ms fast"), -EINVAL);
+}
+
+static void vts_test_gesture(struct kunit *test)
+{
+    int i;
+    struct vinput *vinput = test->priv;
+    struct vts_data *drvdata = vinput->priv_data;
+
+    drvdata->rate = 1000;
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "swipe 2 100,100 900,100 10ms"),
+                    28);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "press 1,1 10ms"), -EBUSY);
+
+    for (i = 0; i < 100 && READ_ONCE(drvdata->gesturing); i++)
+        msleep(10);
+    KUNIT_EXPECT_FALSE(test, READ_ONCE(drvdata->gesturing));
+
+    /* 10 steps from progress 0 to 1, then the lift */
+    KUNIT_EXPECT_EQ(test, drvdata->player.played, 12U);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_POSITION_X), 900);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 0, ABS_MT_TRACKING_ID), -1);
+    KUNIT_EXPECT_EQ(test, vts_slot_value(vinput, 1, ABS_MT_TRACKING_ID), -1);
+    KUNIT_EXPECT_EQ(test, drvdata->slots[0].id, -1);
+    KUNIT_EXPECT_EQ(test, drvdata->slots[1].id, -1);
+}
+
+static void vts_test_config(struct kunit *test)
+{
+    struct vts_data *drvdata;
+    struct vinput *vinput;
+    struct vinput_config config = {
+        .mt_type = 'B',
+        .max_x = 1919,
+        .max_y = 1079,
+        .max_z = -1,
+        .max_points = 10,
+    };
+
+    /* every calibration value is needed */
+    vinput = vinput_test_create_config(&vts_dev, &config);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(vinput), -EINVAL);
+
+    /* more contacts than the slot tables are sized for */
+    config.max_z = 255;
+    config.max_points = VINPUT_MAX_POINTS + 1;
+    vinput = vinput_test_create_config(&vts_dev, &config);
+    KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(vinput), -EINVAL);
+
+    config.max_points = 10;
+    vinput = vinput_test_create_config(&vts_dev, &config);
+    KUNIT_ASSERT_FALSE(test, IS_ERR(vinput));
+    drvdata = vinput->priv_data;
+    KUNIT_EXPECT_TRUE(test, drvdata->registered);
+    KUNIT_EXPECT_EQ(test, input_abs_get_max(vinput->input, ABS_MT_POSITION_X),
+                    1919);
+    KUNIT_EXPECT_EQ(test, vinput->input->mt->num_slots, 10);
+    KUNIT_EXPECT_EQ(test, vts_send_str(vinput, "1,100,100,10"), 12);
+    /* the pointer is emulated from the slots */
+    KUNIT_EXPECT_EQ(test, input_abs_get_val(vinput->input, ABS_X), 100);
+    KUNIT_EXPECT_TRUE(test, test_bit(BTN_TOUCH, vinput->input->key));
+    vinput_test_destroy(vinput);
+}
+
+static void vts_test_throughput(struct kunit *test)
+{
+    int i;
+    u64 start, elapsed;
+    struct vinput *vinput = test->priv;
+
+    start = ktime_get_ns();
+    for (i = 0; i < VTS_TEST_LOOPS; i++)
+        vts_send_str(vinput, "1,100,100,10;2,200,200,10");
+    elapsed = ktime_get_ns() - start;
+
+    kunit_info(test, "vts: %llu ns per two-contact frame\n",
+               div_u64(elapsed, VTS_TEST_LOOPS));
+}
+
+static int vts_test_init(struct kunit *test)
+{
+    int err;
+    struct vts_data *drvdata;
+    struct vinput *vinput = vinput_test_create(&vts_dev);
+
+    if (IS_ERR(vinput))
+        return PTR_ERR(vinput);
+    test->priv = vinput;
+
+    drvdata = vinput->priv_data;
+    drvdata->type = TYPE_B;
+    drvdata->max_x = 1023;
+    drvdata->max_y = 1023;
+    drvdata->max_z = 255;
+    drvdata->max_points = VTS_TEST_POINTS;
+    err = vinput_vts_register_final(&vinput->dev);
+    if (err)
+        vinput_test_destroy(vinput);
+
+    return err;
+}
+
+static void vts_test_exit(struct kunit *test)
+{
+    vinput_test_destroy(test->priv);
+}
+
+static struct kunit_case vts_test_cases[] = {
+    KUNIT_CASE(vts_test_contact),
+    KUNIT_CASE(vts_test_multi_contact),
+    KUNIT_CASE(vts_test_slot_map),
+    KUNIT_CASE(vts_test_overflow),
+    KUNIT_CASE(vts_test_malformed),
+    KUNIT_CASE(vts_test_unregistered),
+    KUNIT_CASE(vts_test_config),
+    KUNIT_CASE(vts_test_gesture_parse),
+    KUNIT_CASE(vts_test_gesture),
+    KUNIT_CASE(vts_test_throughput),
+    {},
+};
+
+static struct kunit_suite vts_test_suite = {
+    .name = "vinput-vts",
+    .init = vts_test_init,
+    .exit = vts_test_exit,
+    .test_cases = vts_test_cases,
+};
+kunit_test_suite(vts_test_suite);